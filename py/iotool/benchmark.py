@@ -0,0 +1,411 @@
+# The MIT License (MIT)
+#
+# Copyright (c) 2014-2015 WUSTL ZPLAB
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all
+# copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+# SOFTWARE.
+#
+# Authors: Zach Pincus
+
+"""Per-command execution-speed benchmark for an attached IOTool device.
+
+This replays the "Program Step Execution Speed" methodology from the README,
+but uses the device's own tb/te timer in place of an oscilloscope: a program
+that loops over a single test command is timed, and the time taken by the
+same loop with no test command is subtracted. The difference, divided by the
+number of iterations, is the per-step cost of that command.
+
+Results are compared to a stored baseline (by default, the figures listed in
+the README) and any command that got slower than the baseline by more than a
+given tolerance is flagged as a regression.
+
+The time taken by the device to parse a program step is measured separately
+(with --parse): a program of many copies of a step is uploaded in one transfer,
+and the time taken to upload the same number of bytes of blank lines, which
+the device skips without parsing, is subtracted.
+
+The long-run frequency error of a periodic loop is measured with --drift: a
+loop that toggles a pin with a given period is timed over two different
+numbers of iterations, and the period is taken from the difference. This is
+done for a loop timed with dm steps, whose error grows with the time taken by
+the steps in the loop, and for one timed with the wn deadline step, which
+should have none.
+
+The cost of running several sequences at once (with sq steps) is measured with
+--sequences: a loop in the first sequence is timed with up to three other
+sequences running, either busy (looping over no steps) or waiting (on a long
+dm delay). The increase in the time of each step of the timed loop, per other
+sequence, is the latency each sequence adds to the others, beyond the time of
+their own steps. The time taken by the scheduler itself is measured by timing
+the loop on its own, with and without an sq step.
+
+The CPU cost of background debouncing is measured with --debounce: a loop of
+no steps is timed with the debouncer off and then sampling at a given period.
+The extra time, divided by the number of samples taken while the loop ran, is
+the time taken by each sample.
+
+The per-command benchmark can also be run without a device, on the firmware
+built for the simavr simulator, which simulates the timers cycle by cycle. As
+the simulated firmware can't be sent commands as it runs, the commands are
+written out beforehand with --sim-script, to be compiled into it as its input,
+and the te results are read back from the simulator's output with
+--sim-output. "make bench-sim" does all this. The wh and wl commands are not
+benchmarked there, as nothing drives the simulated pins.
+
+Usage:
+    python -m iotool.benchmark /dev/ttyWhatever [--baseline file.json] [--save file.json]
+    python -m iotool.benchmark --sim-script > build-sim/sim_input.h
+    simavr -m atmega32u4 -f 16000000 IOToolSim.elf | python -m iotool.benchmark --sim-output -
+    python -m iotool.benchmark /dev/ttyWhatever --parse
+    python -m iotool.benchmark /dev/ttyWhatever --drift [--period ms]
+    python -m iotool.benchmark /dev/ttyWhatever --sequences
+    python -m iotool.benchmark /dev/ttyWhatever --debounce [--debounce-period µs]
+"""
+
+import argparse
+import json
+import re
+import sys
+import time
+
+from . import io_tool
+
+F_CPU = 16000000
+
+# Per-step cost in µs for each benchmarked command, as listed in the README.
+README_BASELINE = {
+    'wh': 7.2,
+    'wl': 7.2,
+    'pm8': 5.4,
+    'pm16': 5.7,
+    'sh': 5.8,
+    'sl': 5.8,
+    'st': 5.8,
+    'ct': 17,
+    'rd': 30,
+    'ra': 90,
+    'te': 52,
+    'lo': 5,
+    'go': 2.9,
+    'no': 2.6,
+}
+
+def benchmark_steps(pin, input_pin, low_pin, analog_pin, pwm8_pin, pwm16_pin, waits=True):
+    """Return a list of (name, step) pairs to benchmark. The step is placed at
+    index 1 of the timing program, so a step that jumps must jump to index 2.
+
+    The dm and du commands are not listed, as their cost is mostly the delay
+    they are given. Nor is tb, which would restart the timing. If waits is
+    False, neither are wh and wl, which need the pins to be driven (so they
+    are left out in the simulator).
+    """
+    steps = [
+        ('no', 'no'),
+        ('go', 'go 2'),
+        ('sh', 'sh {}'.format(pin)),
+        ('sl', 'sl {}'.format(pin)),
+        ('st', 'st {}'.format(pin)),
+        ('pm8', 'pm {} 128'.format(pwm8_pin)),
+        ('pm16', 'pm {} 512'.format(pwm16_pin)),
+        ('rd', 'rd {}'.format(input_pin)),
+        ('ra', 'ra {}'.format(analog_pin)),
+        ('ct', 'ct 10'),
+        ('te', 'te'),
+    ]
+    if waits:
+        steps.append(('wh', 'wh {}'.format(input_pin))) # pull-up keeps an unconnected pin high
+        if low_pin is not None:
+            steps.append(('wl', 'wl {}'.format(low_pin)))
+    return steps
+
+def _timed_run(device, *steps):
+    """Store and run a program that starts with tb and ends with te, and
+    return the µs value reported by the final te."""
+    device.store_program('tb', *steps, 'te')
+    device.start_program()
+    output = device.wait_until_done().split()
+    return int(output[-1])
+
+def run_benchmark(device, iters=1000, pin='D6', input_pin='B0', low_pin=None,
+        analog_pin='F0', pwm8_pin='B7', pwm16_pin='B5', waits=True):
+    """Time each command on an attached device. Returns a dict mapping command
+    names to per-step cost in µs. See benchmark_steps() for waits."""
+    device.execute('wt 0')
+    results = {}
+    empty = _timed_run(device, 'lo 1 0')
+    loop_only = _timed_run(device, 'lo 1 {}'.format(iters))
+    results['lo'] = (loop_only - empty) / iters
+    for name, step in benchmark_steps(pin, input_pin, low_pin, analog_pin, pwm8_pin, pwm16_pin, waits):
+        elapsed = _timed_run(device, step, 'lo 1 {}'.format(iters))
+        results[name] = (elapsed - loop_only) / (iters + 1)
+    device.execute('wt 10')
+    return results
+
+def parse_benchmark_steps(pin, analog_pin, pwm16_pin):
+    """Return a list of steps whose parse time is to be measured."""
+    return [
+        'no',
+        'sh {}'.format(pin),
+        'wt 10',
+        'ra {}'.format(analog_pin),
+        'pm {} 512'.format(pwm16_pin),
+        'wh {}'.format(pin),
+        'hp {} 10 100 1'.format(pwm16_pin),
+    ]
+
+def _timed_upload(device, lines, repeats):
+    elapsed = 0
+    for i in range(repeats):
+        device.execute('program', 'end') # clear the program, so that store_program() won't skip the upload
+        start = time.perf_counter()
+        device.store_program(*lines)
+        elapsed += time.perf_counter() - start
+    return elapsed
+
+def run_parse_benchmark(device, steps=250, repeats=10, pin='D6', analog_pin='F0', pwm16_pin='B5'):
+    """Time how long the device takes to parse each kind of step. Returns a
+    dict mapping steps to per-step parse time in µs."""
+    results = {}
+    for step in parse_benchmark_steps(pin, analog_pin, pwm16_pin):
+        count = 8 if step.startswith('hp') else steps # hp steps are limited by the pulse-train table
+        blank = _timed_upload(device, [' ' * len(step)] * count, repeats)
+        parsed = _timed_upload(device, [step] * count, repeats)
+        results[step] = (parsed - blank) / (count * repeats) * 1e6
+    device.execute('program', 'end') # clear the program
+    return results
+
+def drift_loops(pin, period_ms):
+    """Return a dict mapping names to the steps of a loop body that sets the
+    pin high for half of the period and low for the rest."""
+    high_ms = period_ms // 2
+    return {
+        'dm': ['sh {}'.format(pin), 'dm {}'.format(high_ms), 'sl {}'.format(pin), 'dm {}'.format(period_ms - high_ms)],
+        'wn': ['sh {}'.format(pin), 'wu {}'.format(high_ms * 1000), 'sl {}'.format(pin), 'wn {}'.format(period_ms * 1000)],
+    }
+
+def run_drift_benchmark(device, period_ms=10, iterations=(100, 1000), pin='D6'):
+    """Measure the long-run frequency error of a periodic loop, timed with dm
+    and with wn. Returns a dict mapping those names to the error in parts per
+    million, positive if the loop runs slow."""
+    results = {}
+    for name, body in drift_loops(pin, period_ms).items():
+        elapsed = [_timed_run(device, *body, 'lo 1 {}'.format(count - 1)) for count in iterations]
+        period_us = (elapsed[1] - elapsed[0]) / (iterations[1] - iterations[0])
+        results[name] = (period_us / (period_ms * 1000) - 1) * 1e6
+    return results
+
+def sequence_program(iters, others, step):
+    """Return the steps of a program whose first sequence times a loop of a
+    no step, while the given number of other sequences each repeat the given
+    step forever. With others=None, there are no sq steps at all."""
+    lines = ['tb', 'no', 'lo 1 {}'.format(iters), 'te']
+    if others is None:
+        return lines
+    lines.append('sq') # so that the scheduler runs even with no other sequences
+    for i in range(others):
+        if i > 0:
+            lines.append('sq')
+        start = len(lines)
+        lines += [step, 'go {}'.format(start)]
+    return lines
+
+def run_sequence_benchmark(device, iters=1000, others=3):
+    """Measure the latency added by running sequences concurrently. Returns a
+    dict with the µs added to each step by the scheduler ('scheduler'), and
+    added to each step of one sequence by each other busy or waiting sequence
+    ('busy' and 'waiting')."""
+    def time_program(count, step='no'):
+        device.store_program(*sequence_program(iters, count, step))
+        device.start_program()
+        return int(device.wait_until_done().split()[-1])
+    steps = 2 * (iters + 1) # the no and lo steps of each iteration
+    plain = time_program(None)
+    alone = time_program(0)
+    results = {'scheduler': (alone - plain) / steps}
+    for name, step in [('busy', 'no'), ('waiting', 'dm 60000')]:
+        results[name] = (time_program(others, step) - alone) / (others * steps)
+    return results
+
+def run_debounce_benchmark(device, iters=10000, period_us=1000):
+    """Measure the CPU time taken by each sample of the background debouncer,
+    sampling with the given period. Returns a dict with the µs and CPU cycles
+    (at 16 MHz) per sample."""
+    steps = ('no', 'lo 1 {}'.format(iters))
+    device.set_debounce(0)
+    off = _timed_run(device, *steps)
+    device.set_debounce(period_us)
+    try:
+        on = _timed_run(device, *steps)
+    finally:
+        device.set_debounce(0)
+    us = (on - off) / (on / period_us)
+    return {'us': us, 'cycles': us * 16}
+
+class SimulatedIOTool:
+    """Stands in for io_tool.IOTool to run a benchmark on the firmware built
+    for the simavr simulator (see "make bench-sim"), which takes its input
+    from a script compiled into it rather than from a host as it runs. So the
+    benchmark is run twice: first to record the commands it sends, which
+    sim_script_header() makes into that script; and then, once the simulation
+    has run, to take the result of each run in turn from its output."""
+    def __init__(self, outputs=None):
+        self.script = []
+        self._outputs = None if outputs is None else iter(outputs)
+
+    def execute(self, *commands):
+        self.script.extend(commands)
+
+    def store_program(self, *commands):
+        self.script += ['program'] + list(commands) + ['end']
+
+    def start_program(self):
+        self.script.append('run')
+
+    def wait_until_done(self):
+        if self._outputs is None:
+            return '0' # not simulated yet
+        try:
+            return next(self._outputs)
+        except StopIteration:
+            raise RuntimeError('The simulator output has fewer results than the benchmark has runs') from None
+
+def sim_script_header(script):
+    """Return a C header defining the commands of a script as the serial input
+    of the simulator build."""
+    lines = ['// Generated by "python -m iotool.benchmark --sim-script"; see "make bench-sim".',
+             'static const char sim_input[] PROGMEM =']
+    lines += ['    "{}\\n"'.format(command) for command in script]
+    lines[-1] += ';'
+    return '\n'.join(lines) + '\n'
+
+# simavr writes each line of console output with a prefix, and perhaps color
+# codes; the output of the simulator build has no echo, but may start with
+# prompts. A line of output holding just a number is a te result.
+_SIM_COLOR = re.compile(r'\x1b\[[0-9;]*m')
+_SIM_RESULT = re.compile(r'(?:^|[:>])(\d+)$')
+
+def read_sim_output(lines):
+    """Return the te results in the output of the simulator build, in order."""
+    results = []
+    for line in lines:
+        line = _SIM_COLOR.sub('', line).strip()
+        if 'ERROR' in line:
+            raise RuntimeError('Simulated benchmark error: {}'.format(line))
+        match = _SIM_RESULT.search(line)
+        if match:
+            results.append(match.group(1))
+    return results
+
+def compare(results, baseline, tolerance):
+    """Return a list of (name, measured, baseline) for all commands that got
+    slower than the baseline by more than the fractional tolerance."""
+    regressions = []
+    for name, measured in sorted(results.items()):
+        expected = baseline.get(name)
+        if expected is not None and measured > expected * (1 + tolerance):
+            regressions.append((name, measured, expected))
+    return regressions
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description='Benchmark IOTool program step execution speed.')
+    parser.add_argument('port', nargs='?', help='serial port of the IOTool device (not used with --sim-script or --sim-output)')
+    parser.add_argument('--iters', type=int, default=1000, help='loop iterations per measurement')
+    parser.add_argument('--pin', default='D6', help='output pin for set commands')
+    parser.add_argument('--input-pin', default='B0', help='unconnected pin for wait-high and read commands')
+    parser.add_argument('--low-pin', help='pin tied to ground, for the wait-low command (skipped if not given)')
+    parser.add_argument('--analog-pin', default='F0', help='pin for analog reads')
+    parser.add_argument('--pwm8-pin', default='B7', help='8-bit PWM pin')
+    parser.add_argument('--pwm16-pin', default='B5', help='10-bit PWM pin')
+    parser.add_argument('--baseline', help='JSON file of baseline timings (default: README figures)')
+    parser.add_argument('--save', help='write measured timings to this JSON file')
+    parser.add_argument('--tolerance', type=float, default=0.1, help='fractional slowdown flagged as a regression')
+    parser.add_argument('--parse', action='store_true', help='measure per-step parse time instead')
+    parser.add_argument('--drift', action='store_true', help='measure the frequency error of a periodic loop instead')
+    parser.add_argument('--period', type=int, default=10, help='loop period in ms for --drift')
+    parser.add_argument('--sequences', action='store_true', help='measure the latency added by concurrent sequences instead')
+    parser.add_argument('--debounce', action='store_true', help='measure the CPU cost of background debouncing instead')
+    parser.add_argument('--debounce-period', type=int, default=1000, help='debounce sample period in µs for --debounce')
+    parser.add_argument('--sim-script', action='store_true', help='write the per-command benchmark as input for the simulator build, and exit')
+    parser.add_argument('--sim-output', type=argparse.FileType('r'), help='read the per-command timings from the output of the simulator build ("-" for stdin)')
+    args = parser.parse_args(argv)
+
+    def per_command_benchmark(device):
+        return run_benchmark(device, args.iters, args.pin, args.input_pin, args.low_pin,
+            args.analog_pin, args.pwm8_pin, args.pwm16_pin, waits=not isinstance(device, SimulatedIOTool))
+
+    if args.sim_script:
+        device = SimulatedIOTool()
+        per_command_benchmark(device)
+        print(sim_script_header(device.script), end='')
+        return 0
+    if args.port is None and args.sim_output is None:
+        parser.error('the serial port of the device is required')
+
+    regressions = []
+    if args.debounce:
+        device = io_tool.IOTool(args.port)
+        results = run_debounce_benchmark(device, 10 * args.iters, args.debounce_period)
+        print('{:10} {:>12}'.format('per sample', 'value'))
+        for name, value in sorted(results.items()):
+            print('{:10} {:12.2f}'.format(name, value))
+    elif args.sequences:
+        device = io_tool.IOTool(args.port)
+        results = run_sequence_benchmark(device, args.iters)
+        print('{:10} {:>12}'.format('cost', 'µs per step'))
+        for name, us in sorted(results.items()):
+            print('{:10} {:12.2f}'.format(name, us))
+    elif args.drift:
+        device = io_tool.IOTool(args.port)
+        results = run_drift_benchmark(device, args.period, pin=args.pin)
+        print('{:6} {:>12}'.format('loop', 'error ppm'))
+        for name, ppm in sorted(results.items()):
+            print('{:6} {:12.1f}'.format(name, ppm))
+    elif args.parse:
+        device = io_tool.IOTool(args.port)
+        results = run_parse_benchmark(device, pin=args.pin, analog_pin=args.analog_pin, pwm16_pin=args.pwm16_pin)
+        print('{:20} {:>10}'.format('step', 'parse µs'))
+        for step, us in results.items():
+            print('{:20} {:10.2f}'.format(step, us))
+    else:
+        if args.baseline:
+            with open(args.baseline) as f:
+                baseline = json.load(f)
+        else:
+            baseline = README_BASELINE
+        if args.sim_output:
+            device = SimulatedIOTool(read_sim_output(args.sim_output))
+        else:
+            device = io_tool.IOTool(args.port)
+        results = per_command_benchmark(device)
+        print('{:6} {:>10} {:>8} {:>10}'.format('step', 'µs', 'cycles', 'baseline'))
+        for name, us in sorted(results.items()):
+            expected = baseline.get(name)
+            expected = '' if expected is None else '{:.2f}'.format(expected)
+            print('{:6} {:10.2f} {:8.0f} {:>10}'.format(name, us, us * F_CPU / 1e6, expected))
+        regressions = compare(results, baseline, args.tolerance)
+
+    if args.save:
+        with open(args.save, 'w') as f:
+            json.dump(results, f, indent=4, sort_keys=True)
+
+    for name, measured, expected in regressions:
+        print('REGRESSION: {} took {:.2f} µs (baseline {:.2f} µs)'.format(name, measured, expected))
+    return 1 if regressions else 0
+
+if __name__ == '__main__':
+    sys.exit(main())
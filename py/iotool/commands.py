@@ -35,6 +35,18 @@ def wait_low(pin):
 def wait_change(pin):
     return _make_command('wc', pin)
 
+def wait_all(level, *pins):
+    return _make_command('wa', level, *pins)
+
+def wait_pattern(levels, *pins):
+    return _make_command('wp', levels, *pins)
+
+def wait_any(level, *pins):
+    return _make_command('wo', level, *pins)
+
+def wait_any_change(*pins):
+    return _make_command('wx', *pins)
+
 def wait_time(time):
     return _make_command('wt', time)
 
@@ -44,21 +56,72 @@ def read_digital(pin):
 def read_analog(pin):
     return _make_command('ra', pin)
 
+def multi_read(*pins):
+    return _make_command('mr', *pins)
+
 def delay_ms(delay):
     return _make_command('dm', delay)
 
 def delay_us(delay):
     return _make_command('du', delay)
 
-def timer_begin(self):
-    return _make_command('tb')
+def timer_begin(timer=0):
+    return _make_command('tb', timer)
+
+def timer_end(timer=0):
+    return _make_command('te', timer)
 
-def timer_end(self):
-    return _make_command('te')
+def timer_lap(timer=0):
+    return _make_command('tl', timer)
+
+def timer_read():
+    return _make_command('tr')
+
+def mark():
+    return _make_command('mk')
+
+def wait_until(time):
+    return _make_command('wu', time)
+
+def wait_next(period):
+    return _make_command('wn', period)
 
 def pwm(pin, value):
     return _make_command('pm', pin, value)
 
+def hardware_pulse(pin, width, period, count):
+    return _make_command('hp', pin, width, period, count)
+
+def hardware_pulse_wait():
+    return _make_command('hw')
+
+def input_capture_begin(mode):
+    return _make_command('ib', mode)
+
+def input_capture_end():
+    return _make_command('ie')
+
+def logic_begin(divider, *pins):
+    return _make_command('lb', divider, *pins)
+
+def logic_end():
+    return _make_command('le')
+
+def count_begin(pin, falling=False):
+    return _make_command('kb', pin, int(falling))
+
+def count_end(pin):
+    return _make_command('ke', pin)
+
+def count_read(pin):
+    return _make_command('kr', pin)
+
+def count_zero(pin):
+    return _make_command('kz', pin)
+
+def count_frequency(pin, gate_ms):
+    return _make_command('kf', pin, gate_ms)
+
 def set_high(pin):
     return _make_command('sh', pin)
 
@@ -68,6 +131,12 @@ def set_low(pin):
 def set_tristate(pin):
     return _make_command('st', pin)
 
+def multi_set_high(*pins):
+    return _make_command('mh', *pins)
+
+def multi_set_low(*pins):
+    return _make_command('ml', *pins)
+
 def char_transmit(byte):
     return _make_command('ct', byte)
 
@@ -22,13 +22,78 @@
 #
 # Authors: Zach Pincus
 
+import array
+import binascii
 import os
+import struct
+import sys
 import time
 
 from . import smart_serial
 
 _ECHO_OFF = b'\x80\xFF'
 
+# Records produced in binary output mode: tag byte -> (result name, struct
+# format of the little-endian value that follows the tag)
+_BINARY_RECORDS = {
+    b'd': ('digital', '<B'),
+    b'a': ('analog', '<H'),
+    b't': ('timer', '<I'),
+    b'i': ('interval', '<I'),
+    b'x': ('dropped', '<H'),
+    b'r': ('logic_header', '<HH'),
+    b'l': ('logic_run', '<BH'),
+    b'f': ('logic_full', '<'),
+    b'p': ('lap', '<BI'),
+    b'e': ('trace', '<H2s2sI'),
+    b'm': ('pins', '<I'),
+    b'c': ('count', '<I'),
+    b'h': ('frequency', '<I'),
+}
+
+def program_checksum(commands):
+    """Return the checksum of a program that the device reports with the
+    'hash' command: the CRC-16/XMODEM checksum of its non-blank lines, each
+    followed by a single newline."""
+    lines = [line for command in commands for line in command.splitlines() if line.strip()]
+    return binascii.crc_hqx(''.join(line + '\n' for line in lines).encode('ascii'), 0)
+
+_STREAM_BLOCK_SIZE = 64
+_STREAM_FINAL_BLOCK = 0x80
+
+def logic_timeline(records, pins):
+    """Reconstruct the pin transitions recorded by a logic-capture 'le' step.
+
+    Parameters:
+        records: (name, value) pairs, as returned in binary output mode by
+            IOTool.wait_until_done() or IOTool.execute(); records other than
+            those produced by 'le' are ignored.
+        pins: the pin names given to the corresponding 'lb' step.
+
+    Returns (timeline, full), where timeline is a list of (time, levels)
+    pairs, one per run, giving the time in µs since the start of capture and a
+    dict mapping each pin name to its level (0 or 1) from then on; and full is
+    True if the device's buffer filled up, so that capture stopped early.
+    """
+    timeline = []
+    full = False
+    period = 0
+    time = 0
+    for name, value in records:
+        if name == 'logic_header':
+            period, capacity = value
+            timeline = []
+            time = 0
+        elif name == 'logic_run':
+            levels, length = value
+            levels = {pin: (levels >> i) & 1 for i, pin in enumerate(pins)}
+            if not timeline or timeline[-1][1] != levels: # long runs are split in two
+                timeline.append((time, levels))
+            time += length * period
+        elif name == 'logic_full':
+            full = True
+    return timeline, full
+
 class IOTool:
     """Class to control IOTool box. See https://github.com/zachrahan/IOTool for
     documentation about the IOTool microcontroller firmware itself, but in this
@@ -43,7 +108,25 @@ class IOTool:
             raise smart_serial.SerialException('Could not communicate with IOTool device -- is it attached?')
 
     def reset(self):
-        """Attempt to reset the IOTool device to a known-good state."""
+        """Attempt to reset the IOTool device to a known-good state. This is
+        first tried with the 'clear' command, which is quick; only if that
+        fails is the device rebooted, which takes several seconds."""
+        self._binary_output = False
+        try:
+            if not hasattr(self, '_serial_port'):
+                self._serial_port = smart_serial.Serial(self._serial_port_name, timeout=2)
+            self._serial_port.timeout = 2
+            # break out of any running program, as in stop(), then clear
+            self._serial_port.write(b'!\nclear\n')
+            time.sleep(0.1)
+            self._serial_port.read_all_buffered()
+            self._disable_echo() # 'clear' turns echo back on
+        except (smart_serial.SerialException, RuntimeError):
+            self.hard_reset()
+
+    def hard_reset(self):
+        """Reboot the IOTool device and wait for it to reappear."""
+        self._binary_output = False
         if hasattr(self, '_serial_port'):
             del self._serial_port
         self._serial_port = smart_serial.Serial(self._serial_port_name, timeout=2)
@@ -55,9 +138,13 @@ class IOTool:
             if time.time() - wait_start > 5:
                 raise smart_serial.SerialException('IOTool device did not properly reset!')
         self._serial_port = smart_serial.Serial(self._serial_port_name, timeout=2)
+        self._disable_echo()
+
+    def _disable_echo(self):
         self._serial_port.write(_ECHO_OFF + b'\n') # disable echo
         echo_reply = self._wait_for_ready_prompt()
-        assert echo_reply == _ECHO_OFF + b'\r\n' # read back echo of above (no further echoes will come)
+        if echo_reply != _ECHO_OFF + b'\r\n': # read back echo of above (no further echoes will come)
+            raise RuntimeError('Unexpected reply to echo-off: {}'.format(echo_reply))
         self._assert_empty_buffer()
         self._serial_port.timeout = None # change to infinite time-out once initialized and in known-good state,
         # so that waiting for IOTool replies won't cause timeouts
@@ -81,14 +168,128 @@ class IOTool:
         if buffered:
             raise RuntimeError('Unexpected IOTool output: {}'.format(buffered.decode('ascii')))
 
-    def store_program(self, *commands):
+    def set_output_buffering(self, threshold):
+        """Set the number of bytes of results that the IOTool device buffers
+        before sending them to the host. If zero, each result is sent as soon as
+        it is produced. Otherwise, results are also sent every 15 ms and when a
+        program ends. Must be less than 128."""
+        self.execute('buffer {}'.format(threshold))
+
+    def set_binary_output(self, binary):
+        """If binary is True, switch the IOTool device to producing results
+        as compact binary records rather than lines of text. In binary mode,
+        wait_until_done() and execute() return lists of (name, value) pairs,
+        where name is one of 'digital', 'analog', 'timer', 'interval',
+        'dropped', 'logic_header', 'logic_run', 'logic_full', 'lap', 'trace',
+        'pins', 'count' or 'frequency' (or 'text' for any error message). See logic_timeline() for decoding the logic records."""
+        self.execute('binary' if binary else 'text')
+        self._binary_output = binary
+
+    def store_program(self, *commands, upload=True, slot=None):
         """Send a list of commands to IOTool to run as a program, but do not
-        run the program yet."""
-        all_commands = ['program'] + list(commands) + ['end']
-        responses = self.execute(*all_commands)
-        errors = ['{}: {}'.format(command, response) for command, response in zip(all_commands, responses) if response is not None]
-        if errors:
-            raise RuntimeError('Program errors:\n'+'\n'.join(errors))
+        run the program yet.
+
+        If the device already holds this program (as determined by comparing
+        checksums with program_hash()), nothing is sent. Otherwise, if a slot
+        is given and the program saved in that EEPROM slot is the one wanted,
+        it is loaded from there. Failing that, the program is sent, and then
+        saved to the slot if one was given.
+
+        By default, the whole program is sent in one transfer with the 'upload'
+        command. If upload is False, it is instead sent line by line between
+        'program' and 'end', waiting for each line to be acknowledged."""
+        data = ''.join(command + '\n' for command in commands).encode('ascii')
+        crc = binascii.crc_hqx(data, 0) # of the upload
+        checksum = program_checksum(commands)
+        if commands and self.program_hash() == checksum:
+            return
+        if slot is not None:
+            if self.execute('load {}'.format(slot)) is None and self.program_hash() == checksum:
+                return
+        if upload:
+            self._assert_empty_buffer()
+            header = 'upload {} {}\n'.format(len(data), crc).encode('ascii')
+            self._serial_port.write(header + data)
+            response = self.wait_until_done()
+            if response:
+                raise RuntimeError('Program errors:\n{}'.format(response))
+        else:
+            all_commands = ['program'] + list(commands) + ['end']
+            responses = self.execute(*all_commands)
+            errors = ['{}: {}'.format(command, response) for command, response in zip(all_commands, responses) if response is not None]
+            if errors:
+                raise RuntimeError('Program errors:\n'+'\n'.join(errors))
+        if slot is not None:
+            response = self.execute('save {}'.format(slot))
+            if response is not None:
+                raise RuntimeError(response)
+
+    def program_capacity(self):
+        """Return the room left for program steps on the device, as a dict
+        with the number of free bytes of program storage ('bytes'), and the
+        number of loop, hardware-pulse and logic-capture steps that can still
+        be added ('loops', 'pulses' and 'logic')."""
+        self._assert_empty_buffer()
+        self._serial_port.write(b'free\n')
+        # always reported as text; see program_hash()
+        values = [int(value) for value in self._wait_for_ready_prompt().split()]
+        return dict(zip(['bytes', 'loops', 'pulses', 'logic'], values))
+
+    def program_hash(self):
+        """Return the CRC-16/XMODEM checksum of the program stored on the
+        device, as computed from its commands by program_checksum(), or 0 if
+        no program is stored."""
+        self._assert_empty_buffer()
+        self._serial_port.write(b'hash\n')
+        # The hash is always reported as text, so read it directly rather
+        # than with wait_until_done(), which expects binary records in
+        # binary output mode.
+        return int(self._wait_for_ready_prompt().decode('ascii'))
+
+    def set_trace(self, enabled):
+        """If enabled is True, the IOTool device records the time at which
+        each program step completes during each subsequent run, for reading
+        with read_trace(). Tracing adds a few µs to every step, and the trace
+        shares the device's capture buffer with the ib, lb and stream commands,
+        so it is discarded if any of those are used."""
+        self.execute('trace on' if enabled else 'trace off')
+
+    def set_debounce(self, period_us):
+        """Sample all the input pins in the background every period_us µs
+        (100 to 32767), or stop doing so if period_us is 0. While sampling,
+        a pin's debounced level changes only once it has read the same for 4
+        samples in a row. The debounced waits and reads then use that level
+        at once, rather than waiting out the time set by the wt command."""
+        self.execute('debounce {}'.format(period_us))
+
+    def read_trace(self):
+        """Return the trace of the last program run, as a list of (step index,
+        step name, pin name or None, µs since the run started) tuples, one per
+        step executed, and the number of steps that were not recorded once the
+        trace buffer filled up."""
+        self._assert_empty_buffer()
+        self._serial_port.write(b'trace dump\n')
+        steps = []
+        dropped = 0
+        if self._binary_output:
+            for name, value in self._read_binary_records():
+                if name == 'trace':
+                    index, step_name, pin, us = value
+                    pin = pin.rstrip(b'\0').decode('ascii') or None
+                    steps.append((index, step_name.decode('ascii'), pin, us))
+                elif name == 'dropped':
+                    dropped = value
+        else:
+            for line in self._wait_for_ready_prompt().decode('ascii').splitlines():
+                fields = line.split()
+                if not fields:
+                    continue
+                if fields[0] == 'dropped':
+                    dropped = int(fields[1])
+                else:
+                    index, step_name, pin, us = fields
+                    steps.append((int(index), step_name, None if pin == '-' else pin, int(us)))
+        return steps, dropped
 
     def start_program(self, *commands, iters=1):
         """Run a program a given number of times. If no commands are given here,
@@ -102,6 +303,21 @@ class IOTool:
             self._assert_empty_buffer()
         self._serial_port.write('run {}\n'.format(iters).encode('ascii'))
 
+    def stage_program(self, *commands, swap=True):
+        """While a program started with start_program() runs, send the next
+        program to be run in its place. The device stores the new program
+        alongside the running one, without interrupting it. If swap is True,
+        the new program replaces the running one at the start of the next
+        iteration (or when the run ends); otherwise the 'swap' command can be
+        sent later to replace it. The staged program shares the device's
+        program storage with the running one, so both must fit together.
+
+        Nothing is waited for: any errors in the commands appear in the output
+        read by wait_until_done(). (When no program is running, use execute()
+        with 'stage', the commands and then 'swap' or 'end'.)"""
+        lines = ['stage'] + list(commands) + ['swap' if swap else 'end']
+        self._serial_port.write(''.join(line + '\n' for line in lines).encode('ascii'))
+
     def wait_for_serial_char(self):
         """If a program uses the char_transmit command to send a signal to the
         host computer, this function can be used to wait to receive that signal."""
@@ -121,11 +337,67 @@ class IOTool:
         that program. A keyboard interrupt while waiting will force-terminate
         the program/command on the IOTool device, via stop()"""
         try:
+            if self._binary_output:
+                return self._read_binary_records()
             return self._wait_for_ready_prompt().decode('ascii')
         except KeyboardInterrupt as k:
             self.stop()
             raise k
 
+    def _read_binary_records(self):
+        """Decode binary-mode output up to the ready prompt."""
+        records = []
+        while True:
+            tag = self._serial_port.read(1)
+            if tag == b'>':
+                return records
+            if tag in _BINARY_RECORDS:
+                name, format = _BINARY_RECORDS[tag]
+                value = struct.unpack(format, self._serial_port.read(struct.calcsize(format)))
+                if len(value) == 1:
+                    value = value[0]
+                records.append((name, value))
+            else:
+                # error messages are still text
+                line = tag + self._serial_port.read_until(b'\n')
+                records.append(('text', line.decode('ascii').rstrip()))
+
+    def stream_analog(self, rate, *pins):
+        """Stream analog readings from the given pins, which are sampled in turn
+        at the given rate (per pin; at most 25000 samples per second in total).
+
+        Yields (samples, dropped) pairs, one per block received from the
+        device. samples is an array.array of uint16 values with the pins
+        interleaved, so numpy.frombuffer(samples, dtype=numpy.uint16).reshape(-1, len(pins))
+        gives one row per sampling round. dropped is the number of rounds lost
+        because the device's buffer was full. Each block holds whole rounds.
+        Streaming continues until the generator is closed.
+        """
+        self._assert_empty_buffer()
+        self._serial_port.write('stream {} {}\n'.format(rate, ' '.join(pins)).encode('ascii'))
+        final = False
+        try:
+            while not final:
+                samples, dropped, final = self._read_stream_block()
+                yield samples, dropped
+        finally:
+            if not final:
+                self._serial_port.write(b'!')
+                while not final:
+                    samples, dropped, final = self._read_stream_block()
+            self._wait_for_ready_prompt()
+
+    def _read_stream_block(self):
+        header = self._serial_port.read(2)
+        if header == b'ER':
+            raise RuntimeError((header + self._wait_for_ready_prompt()).decode('ascii').strip())
+        data = self._serial_port.read(_STREAM_BLOCK_SIZE - 2)
+        count = header[0] & ~_STREAM_FINAL_BLOCK
+        samples = array.array('H', data[:2*count])
+        if sys.byteorder == 'big':
+            samples.byteswap()
+        return samples, header[1], bool(header[0] & _STREAM_FINAL_BLOCK)
+
     def stop(self):
         """Force-terminate a running program or single-command execution on the
         IOTool device, and wait to confirm that it actually stops."""
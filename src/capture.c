@@ -0,0 +1,353 @@
+// Copyright 2014 Zachary Pincus (zpincus@wustl.edu / zplab.wustl.edu)
+// This file is part of IOTool.
+//
+// IOTool is free software; you can redistribute it and/or modify
+// it under the terms of version 2 of the GNU General Public License as
+// published by the Free Software Foundation.
+
+#include <avr/interrupt.h>
+#include <string.h>
+#include "capture.h"
+#include "counter.h"
+#include "interpreter.h"
+#include "pins.h"
+#include "usb_serial.h"
+
+uint8_t capture_buffer[CAPTURE_BUFFER_SIZE];
+
+volatile bool input_capture_active = false;
+volatile uint16_t captures_stored;
+volatile uint16_t captures_dropped;
+volatile uint16_t timer1_overflows;
+uint8_t capture_mode;
+uint8_t saved_tccr1a;
+
+#define STREAM_MASK (CAPTURE_BUFFER_SIZE - 1)
+uint8_t stream_mux_bits[MAX_STREAM_CHANNELS];
+uint8_t stream_num_channels;
+uint8_t stream_channel; // index of the channel being converted
+bool stream_converting;
+bool stream_dropping; // set when a frame (one sample per channel) won't fit in the buffer
+uint16_t stream_period; // Timer3 counts between samples
+volatile uint16_t stream_head; // byte offsets into capture_buffer; written by the ISR...
+volatile uint16_t stream_tail; // ...and by the main loop, with interrupts disabled
+volatile uint8_t stream_overruns; // frames dropped since the last block was sent
+
+volatile bool logic_capture_active = false;
+volatile bool logic_capture_full;
+uint8_t *volatile logic_record = NULL;
+uint8_t logic_record_size;
+uint8_t logic_num_ports;
+uint8_t logic_port_regs[MAX_LOGIC_PORTS]; // data-space addresses of the PINx registers in use
+uint8_t logic_port_masks[MAX_LOGIC_PORTS];
+uint8_t logic_divider;
+uint8_t logic_countdown;
+uint8_t logic_num_pins;
+uint8_t logic_pin_ports[MAX_LOGIC_PINS]; // index into logic_port_regs for each configured pin
+uint8_t logic_pin_masks[MAX_LOGIC_PINS];
+
+ISR(TIMER1_OVF_vect) {
+    timer1_overflows++;
+}
+
+ISR(TIMER1_CAPT_vect) {
+    uint16_t low = ICR1;
+    uint16_t high = timer1_overflows;
+    if (capture_mode != CAPTURE_PERIODS) {
+        TCCR1B ^= BIT(ICES1); // look for the opposite edge next
+        TIFR1 = BIT(ICF1); // changing the edge can set the capture flag
+    }
+    // If the timer overflowed just before the capture, the overflow ISR hasn't
+    // had a chance to run yet.
+    if (GET_BIT(TIFR1, TOV1) && low < 0x8000) {
+        high++;
+    }
+    if (captures_stored < MAX_CAPTURES) {
+        ((uint32_t *) capture_buffer)[captures_stored++] = ((uint32_t) high << 16) | low;
+    } else {
+        captures_dropped++;
+    }
+}
+
+void input_capture_start(uint8_t mode) {
+    logic_capture_stop(); // shares capture_buffer
+    logic_record = NULL;
+    trace_discard();
+    stop_pulse_train();
+    counter_stop(COUNTER_T1);
+    if (!input_capture_active) {
+        saved_tccr1a = TCCR1A; // retain which PWM outputs are connected
+    }
+    TIMSK1 = 0;
+    TCCR1B = 0; // stop Timer1
+    TCCR1A = 0; // normal mode, so ICR1 is free for input capture; 10-bit PWM is suspended
+    SET_BIT_LO(DDRD, PORTD4); // set ICP1 pin for input
+    SET_BIT_HI(PORTD, PORTD4); // enable pullup resistor
+    capture_mode = mode;
+    captures_stored = 0;
+    captures_dropped = 0;
+    timer1_overflows = 0;
+    TCNT1 = 0;
+    TIFR1 = BIT(ICF1) | BIT(TOV1); // clear pending flags
+    TIMSK1 = BIT(ICIE1) | BIT(TOIE1);
+    input_capture_active = true;
+    // capture the falling edge first only when measuring low pulses
+    TCCR1B = (mode == CAPTURE_LOW_WIDTHS ? 0 : BIT(ICES1)) | BIT(CS10); // start clock, no prescaling
+}
+
+void input_capture_stop(void) {
+    if (!input_capture_active) {
+        return;
+    }
+    TIMSK1 = 0;
+    TCCR1B = TIMER1_PWM_MODE; // stop the clock and restore 10-bit PWM
+    TCCR1A = saved_tccr1a;
+    ICR1 = PWM16_MAX;
+    TCNT1 = 0;
+    TCCR1B = TIMER1_PWM_MODE | BIT(CS10);
+    input_capture_active = false;
+}
+
+// Each sample period, store the result of the last conversion and start the next.
+ISR(TIMER3_COMPB_vect) {
+    OCR3B += stream_period; // fire again in one period (wraparound expected; works great)
+    if (stream_converting) {
+        uint16_t sample = ADC;
+        if (stream_channel == 0) {
+            // only start storing a frame if all of it fits, so the channels stay in order
+            uint16_t used = (stream_head - stream_tail) & STREAM_MASK;
+            stream_dropping = used + 2*stream_num_channels > CAPTURE_BUFFER_SIZE - 2;
+            if (stream_dropping && stream_overruns < 255) {
+                stream_overruns++;
+            }
+        }
+        if (!stream_dropping) {
+            *(uint16_t *) (capture_buffer + stream_head) = sample;
+            stream_head = (stream_head + 2) & STREAM_MASK;
+        }
+        stream_channel++;
+        if (stream_channel == stream_num_channels) {
+            stream_channel = 0;
+        }
+    }
+    uint8_t mux_bits = stream_mux_bits[stream_channel];
+    SET_MASKED_BITS(ADMUX, ADMUX_MUX_MASK, mux_bits);
+    SET_MASKED_BITS(ADCSRB, ADCSRB_MUX_MASK, mux_bits);
+    SET_BIT_HI(ADCSRA, ADSC); // start ADC conversion
+    stream_converting = true;
+}
+
+uint16_t stream_bytes_used(void) {
+    cli();
+    uint16_t used = (stream_head - stream_tail) & STREAM_MASK;
+    sei();
+    return used;
+}
+
+void send_stream_block(uint16_t bytes, uint8_t flags) {
+    uint8_t header[2];
+    header[0] = flags | (bytes / 2);
+    cli();
+    header[1] = stream_overruns;
+    stream_overruns = 0;
+    sei();
+    usb_serial_write_data(header, 2);
+    uint16_t to_end = CAPTURE_BUFFER_SIZE - stream_tail;
+    if (bytes > to_end) {
+        usb_serial_write_data(capture_buffer + stream_tail, to_end);
+        usb_serial_write_data(capture_buffer, bytes - to_end);
+    } else {
+        usb_serial_write_data(capture_buffer + stream_tail, bytes);
+    }
+    // pad out a short final block, so the host can always read whole blocks
+    uint8_t zero = 0;
+    for (uint8_t padding = STREAM_BLOCK_SIZE - 2 - bytes; padding > 0; padding--) {
+        usb_serial_write_data(&zero, 1);
+    }
+    cli();
+    stream_tail = (stream_tail + bytes) & STREAM_MASK;
+    sei();
+    usb_serial_flush();
+}
+
+void adc_stream(uint16_t rate, uint8_t *channels, uint8_t num_channels) {
+    input_capture_stop(); // these share capture_buffer
+    logic_capture_stop();
+    logic_record = NULL;
+    trace_discard();
+    for (uint8_t i = 0; i < num_channels; i++) {
+        stream_mux_bits[i] = PIN_BYTE(channels[i], adc_mux_bits);
+    }
+    stream_num_channels = num_channels;
+    // send whole frames in each block, so every block starts with the first channel
+    uint16_t block_bytes = 2*num_channels * ((STREAM_BLOCK_SIZE - 2) / (2*num_channels));
+    stream_period = 2000000UL / ((uint32_t) rate * num_channels); // one channel per match, so num_channels per round
+    stream_head = 0;
+    stream_tail = 0;
+    stream_overruns = 0;
+    stream_channel = 0;
+    stream_converting = false;
+    stream_dropping = false;
+    running = true;
+    SET_TIMER3_COMPARE(OCR3B, stream_period);
+    TIFR3 = BIT(OCF3B); // clear any timer-match flags present
+    SET_MASK_HI(TIMSK3, BIT(OCIE3B));
+    while (running) {
+        uint8_t data;
+        if (stream_bytes_used() >= block_bytes) {
+            send_stream_block(block_bytes, 0);
+        }
+        if (usb_serial_has_byte(&data) && data == QUIT_BYTE) {
+            running = false;
+        }
+    }
+    SET_MASK_LO(TIMSK3, BIT(OCIE3B));
+    while (GET_BIT(ADCSRA, ADSC)) {} // let any conversion in progress finish
+    if (!stream_dropping) {
+        // discard the samples of an incomplete last frame
+        stream_head = (stream_head - 2*stream_channel) & STREAM_MASK;
+    }
+    uint16_t used;
+    uint16_t bytes;
+    do {
+        used = stream_bytes_used();
+        bytes = used < block_bytes ? used : block_bytes;
+        send_stream_block(bytes, bytes == used ? STREAM_FINAL_BLOCK : 0);
+    } while (bytes != used);
+}
+
+void logic_sample(uint8_t *values) {
+    for (uint8_t i = 0; i < logic_num_ports; i++) {
+        values[i] = *(volatile uint8_t *)(uintptr_t) logic_port_regs[i] & logic_port_masks[i];
+    }
+}
+
+ISR(TIMER4_OVF_vect) {
+    if (--logic_countdown) {
+        return;
+    }
+    logic_countdown = logic_divider;
+    uint8_t values[MAX_LOGIC_PORTS];
+    logic_sample(values);
+    uint8_t *record = logic_record;
+    uint16_t *run_length = (uint16_t *) record;
+    if (*run_length != 0xFFFF && memcmp(values, record + 2, logic_num_ports) == 0) {
+        (*run_length)++;
+        return;
+    }
+    // start a new run (also when the run length would overflow)
+    record += logic_record_size;
+    if (record + logic_record_size > capture_buffer + CAPTURE_BUFFER_SIZE) {
+        logic_capture_full = true;
+        SET_MASK_LO(TIMSK4, BIT(TOIE4));
+        return;
+    }
+    *(uint16_t *) record = 1;
+    memcpy(record + 2, values, logic_num_ports);
+    logic_record = record;
+}
+
+void logic_capture_start(struct logic_config *config) {
+    logic_capture_stop();
+    input_capture_stop(); // shares capture_buffer
+    trace_discard();
+    logic_num_pins = config->num_pins;
+    logic_num_ports = 0;
+    for (uint8_t i = 0; i < config->num_pins; i++) {
+        struct resolved_pin pin;
+        resolve_pin(config->pins[i], &pin);
+        SET_RESOLVED_LOW(&pin, DDR); // set pin for input
+        SET_RESOLVED_HIGH(&pin, PORT); // enable pullup resistor
+        uint8_t port = 0;
+        while (port < logic_num_ports && logic_port_regs[port] != pin.pin_reg) {
+            port++;
+        }
+        if (port == logic_num_ports) {
+            logic_port_regs[port] = pin.pin_reg;
+            logic_port_masks[port] = 0;
+            logic_num_ports++;
+        }
+        logic_port_masks[port] |= pin.mask;
+        logic_pin_ports[i] = port;
+        logic_pin_masks[i] = pin.mask;
+    }
+    logic_record_size = 2 + logic_num_ports;
+    logic_record = capture_buffer;
+    *(uint16_t *) logic_record = 1;
+    logic_sample(logic_record + 2);
+    logic_divider = config->divider;
+    logic_countdown = config->divider;
+    logic_capture_full = false;
+    logic_capture_active = true;
+    TIFR4 = BIT(TOV4); // clear any pending overflow
+    SET_MASK_HI(TIMSK4, BIT(TOIE4));
+}
+
+void logic_capture_stop(void) {
+    SET_MASK_LO(TIMSK4, BIT(TOIE4));
+    logic_capture_active = false;
+}
+
+uint8_t logic_levels(uint8_t *record) {
+    uint8_t levels = 0;
+    for (uint8_t i = 0; i < logic_num_pins; i++) {
+        if (record[2 + logic_pin_ports[i]] & logic_pin_masks[i]) {
+            levels |= BIT(i);
+        }
+    }
+    return levels;
+}
+
+bool trace_enabled = false;
+bool trace_active = false;
+uint8_t *trace_end = capture_buffer;
+uint16_t trace_dropped = 0;
+uint32_t trace_last; // time of the previous record
+
+void trace_start(void) {
+    input_capture_stop(); // these share capture_buffer
+    logic_capture_stop();
+    logic_record = NULL;
+    trace_end = capture_buffer;
+    trace_dropped = 0;
+    trace_last = timebase_now();
+    trace_active = true;
+}
+
+void trace_discard(void) {
+    trace_active = false;
+    trace_end = capture_buffer;
+    trace_dropped = 0;
+}
+
+static uint8_t *write_varint(uint8_t *out, uint32_t value) {
+    while (value >= 0x80) {
+        *out++ = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    *out++ = value;
+    return out;
+}
+
+uint32_t read_varint(uint8_t **in) {
+    uint32_t value = 0;
+    uint8_t shift = 0;
+    uint8_t byte;
+    do {
+        byte = *(*in)++;
+        value |= (uint32_t) (byte & 0x7F) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+// Most steps are recorded in 3 or 4 bytes, so about 150 fit in the buffer.
+void trace_step(uint16_t offset) {
+    uint32_t now = timebase_now();
+    if (trace_end > capture_buffer + CAPTURE_BUFFER_SIZE - MAX_TRACE_RECORD) {
+        trace_dropped++;
+        return;
+    }
+    trace_end = write_varint(write_varint(trace_end, offset), now - trace_last);
+    trace_last = now;
+}
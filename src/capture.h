@@ -0,0 +1,85 @@
+// Copyright 2014 Zachary Pincus (zpincus@wustl.edu / zplab.wustl.edu)
+// This file is part of IOTool.
+//
+// IOTool is free software; you can redistribute it and/or modify
+// it under the terms of version 2 of the GNU General Public License as
+// published by the Free Software Foundation.
+
+#ifndef capture_h
+#define capture_h
+
+#include "utils.h"
+
+// RAM buffer for recording data in the background while a program runs.
+#define CAPTURE_BUFFER_SIZE 512
+extern uint8_t capture_buffer[];
+
+// Input capture: timestamps edges on the ICP1 pin (D4) with Timer1, in 62.5 ns ticks.
+typedef enum {CAPTURE_HIGH_WIDTHS, CAPTURE_LOW_WIDTHS, CAPTURE_PERIODS} capture_mode_t;
+#define MAX_CAPTURES (CAPTURE_BUFFER_SIZE / sizeof(uint32_t))
+
+extern volatile bool input_capture_active;
+extern volatile uint16_t timer1_overflows; // upper 16 bits of the capture timestamps, or of a Timer1 edge count
+extern volatile uint16_t captures_stored;
+extern volatile uint16_t captures_dropped;
+extern uint8_t capture_mode;
+
+void input_capture_start(uint8_t mode);
+void input_capture_stop(void);
+
+// ADC streaming: analog channels are sampled round-robin from a Timer3
+// compare-match ISR into capture_buffer, while the main loop sends the samples
+// to the host in fixed-size blocks until the quit byte is received. Each block
+// is a two-byte header (the number of samples in the block, with the high bit
+// set in the final block; and the number of frames dropped since the previous
+// block) followed by the samples, as little-endian uint16 values.
+#define MAX_STREAM_CHANNELS 8
+#define MAX_STREAM_SAMPLE_RATE 25000 // samples per second, over all channels; an ADC conversion takes 26 µs
+#define MIN_STREAM_SAMPLE_RATE 31 // so that the sample period fits in 16 bits of Timer3 counts
+#define STREAM_BLOCK_SIZE 64 // one full USB packet
+#define STREAM_FINAL_BLOCK 0x80
+
+void adc_stream(uint16_t rate, uint8_t *channels, uint8_t num_channels);
+
+// Logic analyzer: samples the selected pins on every divider'th overflow of
+// Timer4 (every 32 µs), and stores a run-length-encoded record each time any of
+// them changes: the run length in samples (uint16), then the masked value of
+// each port in use. Sampling stops when capture_buffer is full.
+#define MAX_LOGIC_PINS 8
+#define MAX_LOGIC_PORTS 5 // B, C, D, E, F
+#define LOGIC_TICK_US 32
+struct logic_config {
+    uint8_t divider;
+    uint8_t num_pins;
+    uint8_t pins[MAX_LOGIC_PINS]; // indices into pins[]
+};
+
+extern struct logic_config logic_configs[]; // parameters of the lb steps in the program
+extern volatile bool logic_capture_active;
+extern volatile bool logic_capture_full;
+extern uint8_t *volatile logic_record; // the run being counted; NULL if there is no capture
+extern uint8_t logic_record_size;
+extern uint8_t logic_divider;
+
+void logic_capture_start(struct logic_config *config);
+void logic_capture_stop(void);
+uint8_t logic_levels(uint8_t *record); // bit i is the level of the i'th configured pin
+
+// Step trace: while a program runs with tracing on, a record is stored as each
+// step completes: the step's byte offset in the program, then the time since
+// the previous record (or the start of the run) in half-microseconds, each as
+// a varint of 7 bits per byte, low bits first, with the high bit set on all
+// but the last byte. Recording stops when capture_buffer is full.
+#define MAX_TRACE_RECORD 8 // 3 bytes of offset, 5 of time
+
+extern bool trace_enabled; // set by the trace command
+extern bool trace_active; // recording during a run
+extern uint8_t *trace_end; // past the last record; capture_buffer if there is no trace
+extern uint16_t trace_dropped;
+
+void trace_start(void);
+void trace_discard(void);
+void trace_step(uint16_t offset);
+uint32_t read_varint(uint8_t **in);
+
+#endif /* capture_h */
@@ -11,79 +11,161 @@
 #include "utils.h"
 #include "pins.h"
 #include "usb_serial.h"
+#include "capture.h"
+#include "edge_wait.h"
+#include "debounce.h"
+#include "counter.h"
 #include <stdlib.h>
 #include <string.h>
+#include <avr/pgmspace.h>
 
-uint16_t steady_wait_time_half_us = 20;
-uint16_t starting_us_timer;
+uint16_t steady_wait_time_half_us = DEFAULT_WAIT_TIME_HALF_US;
+uint32_t timer_starts[NUM_TIMERS]; // timebase at the last tb of each timer
 
-void undebounced_wait_high(void *params) {
-    uint8_t pin_number = *(uint8_t *) params;
-    SET_PIN_LOW(pin_number, ddr); // set pin for input
-    SET_PIN_HIGH(pin_number, port); // enable pullup resistor
-    while (!GET_PIN(pin_number, pin) && running) {}
+struct lap {
+    uint8_t timer;
+    uint32_t us;
+};
+struct lap lap_log[LAP_LOG_SIZE];
+uint8_t laps_stored = 0;
+uint16_t laps_dropped = 0;
+
+// Write a result as a line of decimal digits, or in binary output mode as
+// a tag byte followed by the low size bytes of the value, little-endian.
+void write_result(uint8_t tag, uint32_t value, uint8_t size) {
+    if (binary_output) {
+        usb_serial_write_data(&tag, 1);
+        usb_serial_write_data(&value, size);
+        return;
+    }
+    char result[11];
+    if (size > 2) {
+        ultoa(value, result, 10);
+    } else {
+        utoa((uint16_t) value, result, 10); // avoid 32-bit division when possible
+    }
+    usb_serial_write_string(result);
+    usb_serial_write_byte('\n');
 }
 
-void undebounced_wait_low(void *params) {
-    uint8_t pin_number = *(uint8_t *) params;
-    SET_PIN_LOW(pin_number, ddr); // set pin for input
-    SET_PIN_HIGH(pin_number, port); // enable pullup resistor
-    while (GET_PIN(pin_number, pin) && running) {}
+// As above, for a result of two values; the second is always 2 bytes.
+void write_result_pair(uint8_t tag, uint16_t first, uint8_t first_size, uint16_t second) {
+    if (binary_output) {
+        usb_serial_write_data(&tag, 1);
+        usb_serial_write_data(&first, first_size);
+        usb_serial_write_data(&second, 2);
+        return;
+    }
+    char result[6];
+    utoa(first, result, 10);
+    usb_serial_write_string(result);
+    usb_serial_write_byte(' ');
+    utoa(second, result, 10);
+    usb_serial_write_string(result);
+    usb_serial_write_byte('\n');
 }
 
-void undebounced_wait_change(void *params) {
-    uint8_t pin_number = *(uint8_t *) params;
-    SET_PIN_LOW(pin_number, ddr); // set pin for input
-    SET_PIN_HIGH(pin_number, port); // enable pullup resistor
-    uint8_t current = GET_PIN(pin_number, pin);
-    while (GET_PIN(pin_number, pin) == current && running) {}
+// Wait for the pin to read the target level (0 or 1), sleeping on an edge
+// interrupt if the pin has one and polling otherwise. Returns the number of
+// following program steps that were executed by the interrupt; see edge_wait().
+uint8_t wait_for_level(struct resolved_pin *pin, uint8_t target, uint8_t *next_step, void *next_params) {
+    uint8_t steps_done = edge_wait(pin, target, next_step, next_params);
+    if (steps_done != EDGE_WAIT_UNAVAILABLE) {
+        return steps_done;
+    }
+    if (target) {
+        while (!GET_RESOLVED(pin) && running) {}
+    } else {
+        while (GET_RESOLVED(pin) && running) {}
+    }
+    return 0;
+}
+
+uint8_t undebounced_wait_high(void *params, uint8_t *next_step, void *next_params) {
+    struct resolved_pin *pin = params;
+    SET_RESOLVED_LOW(pin, DDR); // set pin for input
+    SET_RESOLVED_HIGH(pin, PORT); // enable pullup resistor
+    return wait_for_level(pin, 1, next_step, next_params);
 }
 
-void steady_wait(uint8_t pin_number, uint8_t target) {
-    TCCR3B = TIMER3_DISABLE; // disable timer 3 while we set up the compare registers
+uint8_t undebounced_wait_low(void *params, uint8_t *next_step, void *next_params) {
+    struct resolved_pin *pin = params;
+    SET_RESOLVED_LOW(pin, DDR); // set pin for input
+    SET_RESOLVED_HIGH(pin, PORT); // enable pullup resistor
+    return wait_for_level(pin, 0, next_step, next_params);
+}
+
+uint8_t undebounced_wait_change(void *params, uint8_t *next_step, void *next_params) {
+    struct resolved_pin *pin = params;
+    SET_RESOLVED_LOW(pin, DDR); // set pin for input
+    SET_RESOLVED_HIGH(pin, PORT); // enable pullup resistor
+    return wait_for_level(pin, !GET_RESOLVED(pin), next_step, next_params);
+}
+
+void steady_wait(struct resolved_pin *pin, uint8_t target) {
+    SET_TIMER3_COMPARE(OCR3B, steady_wait_time_half_us); // set up match time (wraparound expected; works great)
     TIFR3 = BIT(OCF3B); // clear any timer-match flags present
-    OCR3B = TCNT3 + steady_wait_time_half_us; // set up match time (wraparound expected; works great)
-    TCCR3B = TIMER3_ENABLE; // start timer 3
     while (!GET_BIT(TIFR3, OCF3B) && running) {
-        if ((GET_PIN(pin_number, pin) != 0) != target) { // if the pin changes, reset the wait time
-            //NB: the (GET_PIN(pin_number, pin) != 0) bit above is to convert a pin value, which could be any bit set in the byte, to a strict 0 or 1
-            TCCR3B = TIMER3_DISABLE; // disable timer 3 while we set up the compare registers
+        if ((GET_RESOLVED(pin) != 0) != target) { // if the pin changes, reset the wait time
+            //NB: the (GET_RESOLVED(pin) != 0) bit above is to convert a pin value, which could be any bit set in the byte, to a strict 0 or 1
+            SET_TIMER3_COMPARE(OCR3B, steady_wait_time_half_us); // set up match time (wraparound expected; works great)
             TIFR3 = BIT(OCF3B); // clear any timer-match flags present
-            OCR3B = TCNT3 + steady_wait_time_half_us; // set up match time (wraparound expected; works great)
-            TCCR3B = TIMER3_ENABLE; // start timer 3
         }
     }
 }
 
-void wait_high(void *params) {
-    uint8_t pin_number = *(uint8_t *) params;
-    SET_PIN_LOW(pin_number, ddr); // set pin for input
-    SET_PIN_HIGH(pin_number, port); // enable pullup resistor
-    while (!GET_PIN(pin_number, pin) && running) {}
+// With debouncing on, the next step can't run until the pin has been steady
+// for the wait time, so the edge interrupt is never allowed to run it. With
+// background debouncing on, the debounced level is polled instead.
+uint8_t debounced_wait(struct resolved_pin *pin, uint8_t target, uint8_t *next_step, void *next_params) {
+    if (debounce_active) {
+        uint8_t port = PORT_INDEX(pin->pin_reg);
+        while (((debounced_ports[port] & pin->mask) != 0) != target && running) {}
+        return 0;
+    }
     if (steady_wait_time_half_us) {
-        steady_wait(pin_number, 1);
+        wait_for_level(pin, target, NULL, NULL);
+        steady_wait(pin, target);
+        return 0;
     }
+    return wait_for_level(pin, target, next_step, next_params);
 }
 
-void wait_low(void *params) {
-    uint8_t pin_number = *(uint8_t *) params;
-    SET_PIN_LOW(pin_number, ddr); // set pin for input
-    SET_PIN_HIGH(pin_number, port); // enable pullup resistor
-    while (GET_PIN(pin_number, pin) && running) {}
-    if (steady_wait_time_half_us) {
-        steady_wait(pin_number, 0);
-    }
+uint8_t wait_high(void *params, uint8_t *next_step, void *next_params) {
+    struct resolved_pin *pin = params;
+    set_debounced_input(pin);
+    return debounced_wait(pin, 1, next_step, next_params);
 }
 
-void wait_change(void *params) {
-    uint8_t pin_number = *(uint8_t *) params;
-    SET_PIN_LOW(pin_number, ddr); // set pin for input
-    SET_PIN_HIGH(pin_number, port); // enable pullup resistor
-    uint8_t current = GET_PIN(pin_number, pin);
-    while (GET_PIN(pin_number, pin) == current && running) {}
-    if (steady_wait_time_half_us) {
-        steady_wait(pin_number, !current);
+uint8_t wait_low(void *params, uint8_t *next_step, void *next_params) {
+    struct resolved_pin *pin = params;
+    set_debounced_input(pin);
+    return debounced_wait(pin, 0, next_step, next_params);
+}
+
+uint8_t wait_change(void *params, uint8_t *next_step, void *next_params) {
+    struct resolved_pin *pin = params;
+    set_debounced_input(pin);
+    uint8_t level = debounce_active ? get_debounced(pin) : GET_RESOLVED(pin);
+    return debounced_wait(pin, !level, next_step, next_params);
+}
+
+uint8_t run_wait(uint8_t opcode, void *params, uint8_t *next_step, void *next_params) {
+    switch (opcode) {
+        case OP_UNDEBOUNCED_WAIT_HIGH:
+            return undebounced_wait_high(params, next_step, next_params);
+        case OP_UNDEBOUNCED_WAIT_LOW:
+            return undebounced_wait_low(params, next_step, next_params);
+        case OP_UNDEBOUNCED_WAIT_CHANGE:
+            return undebounced_wait_change(params, next_step, next_params);
+        case OP_WAIT_HIGH:
+            return wait_high(params, next_step, next_params);
+        case OP_WAIT_LOW:
+            return wait_low(params, next_step, next_params);
+        case OP_WAIT_CHANGE:
+            return wait_change(params, next_step, next_params);
     }
+    return 0;
 }
 
 void set_wait_time(void *params) {
@@ -92,64 +174,132 @@ void set_wait_time(void *params) {
 
 void delay_milliseconds(void *params) {
     uint16_t ms_delay = *(uint16_t *) params;
-    ms_timer = 0; // millisecond timer ISR should be disabled, so it's ok to set this without worrying it'll get stomped on
-    ms_timer_target = ms_delay;
-    ms_timer_done = false;
-    if (ms_timer_target == 0) {
-        return; // special case for bizarre request of 0 ms delay
-    }
-    TCCR3B = TIMER3_DISABLE; // disable timer 3 while we set up the compare registers
-    TIFR3 = BIT(OCF3A); // clear previous output compare matches so ms timer ISR doesn't fire immediately on being enabled
-    SET_MASK_HI(TIMSK3, MS_TIMER_MASK); // enable millisecond timer
-    OCR3A = TCNT3 + 2000; // Fire off the millisecond timer 1 ms after starting the clocks
-    TCCR3B = TIMER3_ENABLE; // start timer 3
-    while (!ms_timer_done && running) {}
-    SET_MASK_LO(TIMSK3, MS_TIMER_MASK); // disable millisecond timer
+    wait_until(timebase_now() + (uint32_t) ms_delay*2000);
 }
 
 void delay_microseconds(void *params) {
     uint16_t half_us_delay = *(uint16_t *) params;
-    TIMSK3 = 0; // no USB interrupts; won't get "quit" signal
+    if (half_us_delay == 0) {
+        return;
+    }
+    uint8_t usb_timer = TIMSK3 & USB_TIMER_MASK;
+    SET_MASK_LO(TIMSK3, USB_TIMER_MASK); // no USB interrupts; won't get "quit" signal
+    SET_TIMER3_COMPARE(OCR3B, half_us_delay); // set up match time (wraparound expected; works great)
     TIFR3 = BIT(OCF3B); // clear any timer-match flags present
-    TCCR3B = TIMER3_DISABLE; // disable timer 3 while we set up the compare registers
-    OCR3B = TCNT3 + half_us_delay; // set up match time (wraparound expected; works great)
-    TCCR3B = TIMER3_ENABLE; // start timer 3
     while (!GET_BIT(TIFR3, OCF3B)) {}
-    TIMSK3 = USB_TIMER_MASK;
+    SET_MASK_HI(TIMSK3, usb_timer);
+}
+
+void pulse(void *params, bool first_high, bool second_high) {
+    // params are those of the first set step; the du and second set step follow
+    uint16_t half_us_delay = *(uint16_t *) (params + PULSE_DELAY_OPERAND);
+    void *second_params = params + PULSE_SECOND_PIN_OPERAND;
+    uint8_t usb_timer = TIMSK3 & USB_TIMER_MASK;
+    SET_MASK_LO(TIMSK3, USB_TIMER_MASK); // no USB interrupts during the pulse; won't get "quit" signal
+    if (first_high) {
+        set_high(params);
+    } else {
+        set_low(params);
+    }
+    if (half_us_delay) {
+        SET_TIMER3_COMPARE(OCR3B, half_us_delay); // set up match time (wraparound expected; works great)
+        TIFR3 = BIT(OCF3B); // clear any timer-match flags present
+        while (!GET_BIT(TIFR3, OCF3B)) {}
+    }
+    if (second_high) {
+        set_high(second_params);
+    } else {
+        set_low(second_params);
+    }
+    SET_MASK_HI(TIMSK3, usb_timer);
 }
 
 void timer_begin(void *params) {
-    ms_timer = 0; // millisecond timer ISR should be disabled, so it's ok to set this without worrying it'll get stomped on
-    TCCR3B = TIMER3_DISABLE; // disable timer 3 while we set up the compare registers
-    TIFR3 = BIT(OCF3A); // clear previous output compare matches so ms timer ISR doesn't fire immediately on being enabled
-    SET_MASK_HI(TIMSK3, MS_TIMER_MASK); // enable millisecond timer
-    OCR3A = TCNT3 + 2000; // Fire off the millisecond timer 1 ms after starting the clocks
-    starting_us_timer = TCNT3;
-    TCCR3B = TIMER3_ENABLE; // start timer 3
+    timer_starts[*(uint8_t *) params] = timebase_now();
+}
+
+// µs since the timer was begun; reading it doesn't stop the timer
+static inline uint32_t timer_elapsed(uint8_t timer) {
+    uint32_t half_us_timed = timebase_now() - timer_starts[timer]; // wraparound expected for the subtraction; no problem
+    return (half_us_timed + 1) / 2;
 }
 
 void timer_end(void *params) {
-    TCCR3B = TIMER3_DISABLE; // disable timer 3 while we read registers
-    uint16_t us_timer = TCNT3;
-    SET_MASK_LO(TIMSK3, MS_TIMER_MASK); // disable millisecond timer
-    TCCR3B = TIMER3_ENABLE; // start timer 3
-    uint16_t half_us_timed = (us_timer - starting_us_timer) % 2000; // wraparound expected for the subtraction; no problem
-    uint32_t us_timed = ((uint32_t) ms_timer)*1000 + half_us_timed/2;
-    if (half_us_timed % 2) {
-        us_timed++;
+    write_result(RESULT_TIMER, timer_elapsed(*(uint8_t *) params), 4);
+    usb_serial_end_result();
+}
+
+void timer_lap(void *params) {
+    uint8_t timer = *(uint8_t *) params;
+    uint32_t us = timer_elapsed(timer);
+    if (laps_stored == LAP_LOG_SIZE) {
+        laps_dropped++;
+        return;
     }
-    char result[11];
-    ultoa(us_timed, result, 10);
-    usb_serial_write_string(result);
-    usb_serial_write_byte('\n');
-    usb_serial_flush();
+    lap_log[laps_stored].timer = timer;
+    lap_log[laps_stored].us = us;
+    laps_stored++;
+}
+
+void timer_read(void *params) {
+    for (uint8_t i = 0; i < laps_stored; i++) {
+        if (binary_output) {
+            uint8_t tag = RESULT_LAP;
+            usb_serial_write_data(&tag, 1);
+            usb_serial_write_data(lap_log + i, sizeof(struct lap));
+        } else {
+            char result[11];
+            utoa(lap_log[i].timer, result, 10);
+            usb_serial_write_string(result);
+            usb_serial_write_byte(' ');
+            ultoa(lap_log[i].us, result, 10);
+            usb_serial_write_string(result);
+            usb_serial_write_byte('\n');
+        }
+    }
+    if (laps_dropped) {
+        if (!binary_output) {
+            usb_serial_write_string_P(PSTR("dropped "));
+        }
+        write_result(RESULT_DROPPED, laps_dropped, 2);
+    }
+    usb_serial_end_result();
+    clear_lap_log();
+}
+
+void clear_lap_log(void) {
+    laps_stored = 0;
+    laps_dropped = 0;
+}
+
+// Wait until the timebase reaches the deadline, which must be less than 2^31
+// ticks (17.9 minutes) away. Returns at once if the deadline has passed.
+void wait_until(uint32_t deadline) {
+    while ((int32_t) (timebase_now() - deadline) < 0 && running) {}
+}
+
+void mark(void *params) {
+    timebase_mark = timebase_now();
+}
+
+void wait_until_offset(void *params) {
+    wait_until(timebase_mark + *(uint32_t *) params);
+}
+
+// Advancing the mark by the period itself, rather than setting it to the time
+// the wait ends, keeps a loop of these to an exact period over any number of
+// iterations, however long the rest of the loop takes (so long as it's less
+// than the period).
+void wait_next(void *params) {
+    timebase_mark += *(uint32_t *) params;
+    wait_until(timebase_mark);
 }
 
 void pwm8(void *params) {
     uint8_t pin_number = *(uint8_t *) params;
     uint8_t pwm_value = *(uint8_t *) (params + 1);
     SET_PIN_HIGH(pin_number, ddr); // set pin for output
-    *((volatile uint8_t *) pins[pin_number].ocr) = pwm_value;
+    *((volatile uint8_t *) PIN_PTR(pin_number, ocr)) = pwm_value;
     ENABLE_PWM(pin_number);
 }
 
@@ -157,35 +307,150 @@ void pwm16(void *params) {
     uint8_t pin_number = *(uint8_t *) params;
     uint16_t pwm_value = *(uint16_t *) (params + 1);
     SET_PIN_HIGH(pin_number, ddr); // set pin for output
-    *((volatile uint16_t *) pins[pin_number].ocr) = pwm_value;
+    *((volatile uint16_t *) PIN_PTR(pin_number, ocr)) = pwm_value;
     ENABLE_PWM(pin_number);
 }
 
-void set_high(void *params) {
+void hardware_pulse(void *params) {
     uint8_t pin_number = *(uint8_t *) params;
-    if (pins[pin_number].ocr != NULL) {
-        DISABLE_PWM(pin_number);
+    struct pulse_train *train = pulse_trains + *(uint8_t *) (params + 1);
+    input_capture_stop(); // Timer1 can't do both at once
+    counter_stop(COUNTER_T1);
+    uint16_t width = train->width_us;
+    uint16_t period = train->period_us;
+    // A single pulse ignores the period, and uses the longest possible one
+    // instead, so that there's plenty of time to stop before a second pulse.
+    // Otherwise, the period must be long enough for the ISR that stops the
+    // train after the last pulse to run before the next one would begin.
+    uint16_t longest = (train->count == 1) ? width : period;
+    // Use the finest Timer1 prescaler for which the longest interval fits in 16 bits.
+    uint8_t clock_select;
+    if (longest < 4096) {
+        clock_select = BIT(CS10); // no prescaling: 62.5 ns ticks
+        width <<= 4;
+        period <<= 4;
+    } else if (longest < 32768) {
+        clock_select = BIT(CS11); // prescaler=8: 0.5 µs ticks
+        width <<= 1;
+        period <<= 1;
+    } else {
+        clock_select = BIT(CS11) | BIT(CS10); // prescaler=64: 4 µs ticks
+        width = (width + 2) >> 2; // round to nearest tick
+        period = (period + 2) >> 2;
+        if (width == 0) {
+            width = 1;
+        }
+    }
+    if (train->count == 1) {
+        period = 0; // TOP of 0xFFFF
     }
+    TIMSK1 = 0; // stop any pulse train in progress
+    TCCR1B = TIMER1_PWM_MODE; // stop the clock while we set up the registers
+    if (pulse_train_active) {
+        DISABLE_PWM(pulse_train_pin);
+    }
+    SET_PIN_LOW(pin_number, port); // pin idles low between pulses and after the train
     SET_PIN_HIGH(pin_number, ddr); // set pin for output
-    SET_PIN_HIGH(pin_number, port); // set pin for output
+    pulse_train_pin = pin_number;
+    pulses_remaining = train->count;
+    pulse_train_active = true;
+    ICR1 = period - 1;
+    // In fast PWM mode, the pin is set at BOTTOM and cleared when the count matches OCR1x.
+    // OCR1x is double-buffered, and will be updated at BOTTOM.
+    *((volatile uint16_t *) PIN_PTR(pin_number, ocr)) = width - 1;
+    TCNT1 = period - 1; // start at TOP, so the first pulse begins on the first tick
+    TIFR1 = BIT(OCF1A) | BIT(OCF1B); // clear any timer-match flags present
+    TIMSK1 = (PIN_PTR(pin_number, ocr) == &OCR1A) ? BIT(OCIE1A) : BIT(OCIE1B);
+    ENABLE_PWM(pin_number);
+    TCCR1B = TIMER1_PWM_MODE | clock_select; // go
 }
 
-void set_low(void *params) {
-    uint8_t pin_number = *(uint8_t *) params;
-    if (pins[pin_number].ocr != NULL) {
-        DISABLE_PWM(pin_number);
+void hardware_pulse_wait(void *params) {
+    while (pulse_train_active && running) {}
+}
+
+void input_capture_begin(void *params) {
+    input_capture_start(*(uint8_t *) params);
+}
+
+void input_capture_end(void *params) {
+    input_capture_stop();
+    uint32_t *timestamps = (uint32_t *) capture_buffer;
+    uint16_t stored = captures_stored;
+    // report the interval between each pair of edges for pulse widths, or between successive edges for periods
+    uint8_t stride = (capture_mode == CAPTURE_PERIODS) ? 1 : 2;
+    for (uint16_t i = 1; i < stored; i += stride) {
+        write_result(RESULT_INTERVAL, timestamps[i] - timestamps[i-1], 4);
     }
-    SET_PIN_HIGH(pin_number, ddr); // set pin for output
-    SET_PIN_LOW(pin_number, port); // set pin for output
+    if (captures_dropped) {
+        if (!binary_output) {
+            usb_serial_write_string_P(PSTR("dropped "));
+        }
+        write_result(RESULT_DROPPED, captures_dropped, 2);
+    }
+    usb_serial_end_result();
 }
 
-void set_tristate(void *params) {
-    uint8_t pin_number = *(uint8_t *) params;
-    if (pins[pin_number].ocr != NULL) {
-        DISABLE_PWM(pin_number);
+void logic_begin(void *params) {
+    logic_capture_start(logic_configs + *(uint8_t *) params);
+}
+
+void logic_end(void *params) {
+    logic_capture_stop();
+    if (logic_record == NULL) {
+        return; // nothing captured, or capture_buffer has been used for something else since
+    }
+    write_result_pair(RESULT_LOGIC_HEADER, logic_divider * LOGIC_TICK_US, 2, CAPTURE_BUFFER_SIZE / logic_record_size);
+    for (uint8_t *record = capture_buffer; record <= logic_record; record += logic_record_size) {
+        write_result_pair(RESULT_LOGIC_RUN, logic_levels(record), 1, *(uint16_t *) record);
+    }
+    if (logic_capture_full) {
+        if (binary_output) {
+            uint8_t tag = RESULT_LOGIC_FULL;
+            usb_serial_write_data(&tag, 1);
+        } else {
+            usb_serial_write_string_P(PSTR("full\n"));
+        }
+    }
+    usb_serial_end_result();
+}
+
+void count_begin(void *params) {
+    counter_start(*(uint8_t *) params, *(uint8_t *) (params + 1));
+}
+
+void count_end(void *params) {
+    uint8_t counter = counter_for_pin(*(uint8_t *) params);
+    counter_stop(counter);
+    write_result(RESULT_COUNT, counter_read(counter), 4);
+    usb_serial_end_result();
+}
+
+void count_read(void *params) {
+    write_result(RESULT_COUNT, counter_read(counter_for_pin(*(uint8_t *) params)), 4);
+    usb_serial_end_result();
+}
+
+void count_zero(void *params) {
+    counter_zero(counter_for_pin(*(uint8_t *) params));
+}
+
+// Write the frequency in Hz of the edges counted over the gate time. The
+// division is split so that it doesn't overflow 32 bits.
+void write_frequency(uint32_t count, uint16_t gate_ms) {
+    uint32_t hz = count / gate_ms * 1000 + count % gate_ms * 1000 / gate_ms;
+    write_result(RESULT_FREQUENCY, hz, 4);
+    usb_serial_end_result();
+}
+
+void count_frequency(void *params) {
+    uint8_t counter = counter_for_pin(*(uint8_t *) params);
+    uint16_t gate_ms = *(uint16_t *) (params + 1);
+    uint32_t start = counter_read(counter);
+    wait_until(timebase_now() + (uint32_t) gate_ms * 2000);
+    if (running) { // an interrupted gate would give a meaningless frequency
+        write_frequency(counter_read(counter) - start, gate_ms);
     }
-    SET_PIN_LOW(pin_number, ddr); // set pin for input
-    SET_PIN_LOW(pin_number, port); // disable pullup resistor
 }
 
 void char_receive(void *params) {
@@ -198,84 +463,195 @@ void char_receive(void *params) {
     run_serial_tasks_from_isr = true;
 }
 
-void char_goto(void *params) {
+uint8_t char_goto(void) {
     run_serial_tasks_from_isr = false; // we'll do this ourselves
     uint8_t data = usb_serial_wait_byte();
     if (data == QUIT_BYTE) {
         running = false;
     }
-    program_counter = data;
     run_serial_tasks_from_isr = true;
+    return data; // the program step to jump to
 }
 
 void char_transmit(void *params) {
     uint8_t output = *(uint8_t *) params;
     usb_serial_write_byte(output);
-    usb_serial_flush();
+    usb_serial_end_result();
 }
 
 void read_digital(void *params) {
-    uint8_t pin_number = *(uint8_t *) params;
-    SET_PIN_LOW(pin_number, ddr); // set pin for input
-    SET_PIN_HIGH(pin_number, port); // enable pullup resistor
-    uint8_t value = GET_PIN(pin_number, pin);
-    if (steady_wait_time_half_us) {
-        TCCR3B = TIMER3_DISABLE; // disable timer 3 while we set up the compare registers
+    struct resolved_pin *pin = params;
+    set_debounced_input(pin);
+    uint8_t value = GET_RESOLVED(pin);
+    if (debounce_active) {
+        value = get_debounced(pin);
+    } else if (steady_wait_time_half_us) {
+        SET_TIMER3_COMPARE(OCR3B, steady_wait_time_half_us); // set up match time (wraparound expected; works great)
         TIFR3 = BIT(OCF3B); // clear any timer-match flags present
-        OCR3B = TCNT3 + steady_wait_time_half_us; // set up match time (wraparound expected; works great)
-        TCCR3B = TIMER3_ENABLE; // start timer 3
         while (!GET_BIT(TIFR3, OCF3B) && running) {
-            uint8_t now_value = GET_PIN(pin_number, pin);
+            uint8_t now_value = GET_RESOLVED(pin);
             if (now_value != value) { // if the pin changes, reset the wait time
                 value = now_value;
-                TCCR3B = TIMER3_DISABLE; // disable timer 3 while we set up the compare registers
-                OCR3B = TCNT3 + steady_wait_time_half_us; // set up match time (wraparound expected; works great)
-                TCCR3B = TIMER3_ENABLE; // start timer 3
+                SET_TIMER3_COMPARE(OCR3B, steady_wait_time_half_us); // set up match time (wraparound expected; works great)
+                TIFR3 = BIT(OCF3B); // clear any timer-match flags present
             }
         }
     }
-    if (value) {
-        usb_serial_write_byte('1');
-    } else {
-        usb_serial_write_byte('0');
+    write_result(RESULT_DIGITAL, value != 0, 1);
+    usb_serial_end_result();
+}
+
+// The set steps on several pins make each pin an output first, then write
+// the ports back to back, so that the pins of each port change together and
+// those of different ports a few cycles apart.
+static void disconnect_pwm(struct pin_set *set) {
+    for (uint8_t i = 0; i < NUM_PINS; i++) {
+        if (PIN_PTR(i, ocr) != NULL && in_pin_set(set, i)) {
+            DISABLE_PWM(i);
+        }
     }
-    usb_serial_write_byte('\n');
-    usb_serial_flush();
 }
 
-void read_analog(void *params) {
-    uint8_t pin_number = *(uint8_t *) params;
-    ADC_MUX(pin_number);
-    SET_BIT_HI(ADCSRA, ADSC); // start ADC conversion
-    while (GET_BIT(ADCSRA, ADSC)) {} // wait for the conversion to end
-    char result[5];
-    utoa((uint16_t) ADC, result, 10);
-    usb_serial_write_string(result);
-    usb_serial_write_byte('\n');
-    usb_serial_flush();
+void multi_set_high(void *params) {
+    struct pin_set *set = params;
+    if (set->pwm) {
+        disconnect_pwm(set);
+    }
+    DDRB |= set->masks[0]; // set pins for output
+    DDRC |= set->masks[1];
+    DDRD |= set->masks[2];
+    DDRE |= set->masks[3];
+    DDRF |= set->masks[4];
+    PORTB |= set->masks[0];
+    PORTC |= set->masks[1];
+    PORTD |= set->masks[2];
+    PORTE |= set->masks[3];
+    PORTF |= set->masks[4];
 }
 
-void loop(void *params) {
-    uint8_t goto_index = *(uint8_t *) params;
-    uint8_t loop_index = *(uint8_t *) (params + 1);
-    if (!loop_active[loop_index]) {
-        // Initialize loop variables if we're not already in this particular loop.
-        // This allows for nested loops to work properly.
-        loop_current_values[loop_index] = loop_initial_values[loop_index];
-        loop_active[loop_index] = true;
+void multi_set_low(void *params) {
+    struct pin_set *set = params;
+    if (set->pwm) {
+        disconnect_pwm(set);
     }
-    if (loop_current_values[loop_index] > 0) {
-        loop_current_values[loop_index]--;
-        program_counter = goto_index;
-    } else {
-        loop_active[loop_index] = false;
+    DDRB |= set->masks[0]; // set pins for output
+    DDRC |= set->masks[1];
+    DDRD |= set->masks[2];
+    DDRE |= set->masks[3];
+    DDRF |= set->masks[4];
+    PORTB &= ~set->masks[0];
+    PORTC &= ~set->masks[1];
+    PORTD &= ~set->masks[2];
+    PORTE &= ~set->masks[3];
+    PORTF &= ~set->masks[4];
+}
+
+// As for rd, but all the pins must be stable for the wait time together.
+void multi_read(void *params) {
+    struct pin_set *set = params;
+    set_debounced_inputs(set);
+    uint8_t values[NUM_PORTS];
+    read_pin_set(set, values);
+    if (debounce_active) {
+        read_debounced_pin_set(set, values);
+    } else if (steady_wait_time_half_us) {
+        SET_TIMER3_COMPARE(OCR3B, steady_wait_time_half_us); // set up match time (wraparound expected; works great)
+        TIFR3 = BIT(OCF3B); // clear any timer-match flags present
+        while (!GET_BIT(TIFR3, OCF3B) && running) {
+            uint8_t now_values[NUM_PORTS];
+            read_pin_set(set, now_values);
+            if (memcmp(now_values, values, NUM_PORTS) != 0) { // if any pin changes, reset the wait time
+                memcpy(values, now_values, NUM_PORTS);
+                SET_TIMER3_COMPARE(OCR3B, steady_wait_time_half_us); // set up match time (wraparound expected; works great)
+                TIFR3 = BIT(OCF3B); // clear any timer-match flags present
+            }
+        }
+    }
+    write_result(RESULT_PINS, pin_set_bits(set, values), 4);
+    usb_serial_end_result();
+}
+
+// Multi-pin waits. Each condition comes down to comparing the pins with a
+// level for each: wa and wp wait until no pin differs from its target level;
+// wo until some pin differs from the opposite of its target (that is, is at
+// its target); and wx until some pin differs from its level at the start.
+// So each poll of the pins is just an XOR for each port. Sets up the pins and
+// the levels to compare them with, and returns true if the wait is for none
+// of the pins to differ, or false if it is for any of them to.
+bool start_multi_wait(uint8_t opcode, void *params, uint8_t *xor_levels) {
+    struct pin_wait *wait = params; // only wait->pins, for wx
+    set_debounced_inputs(&wait->pins);
+    if (opcode == OP_WAIT_ANY_CHANGE) {
+        if (debounce_active) {
+            read_debounced_pin_set(&wait->pins, xor_levels);
+        } else {
+            read_pin_set(&wait->pins, xor_levels);
+        }
+    }
+    for (uint8_t port = 0; port < NUM_PORTS; port++) {
+        uint8_t levels = (opcode == OP_WAIT_ANY_CHANGE) ? xor_levels[port] : wait->levels[port];
+        if (opcode == OP_WAIT_ANY) {
+            levels = ~levels;
+        }
+        xor_levels[port] = levels & wait->pins.masks[port];
+    }
+    return opcode == OP_WAIT_ALL || opcode == OP_WAIT_PATTERN;
+}
+
+// For wo and wx, output the pins that ended the wait.
+void report_multi_wait(void *params, const uint8_t *xor_levels, const uint8_t *values) {
+    uint8_t matched[NUM_PORTS];
+    for (uint8_t port = 0; port < NUM_PORTS; port++) {
+        matched[port] = values[port] ^ xor_levels[port];
     }
+    write_result(RESULT_PINS, pin_set_bits(params, matched), 4);
+    usb_serial_end_result();
 }
 
-void goto_(void *params) {
-    uint8_t goto_index = *(uint8_t *) params;
-    program_counter = goto_index;
+// As with steady_wait(), but any change in the pins means they weren't steady.
+bool pins_steady(const struct pin_set *pins, const uint8_t *values) {
+    SET_TIMER3_COMPARE(OCR3B, steady_wait_time_half_us); // set up match time (wraparound expected; works great)
+    TIFR3 = BIT(OCF3B); // clear any timer-match flags present
+    while (!GET_BIT(TIFR3, OCF3B) && running) {
+        uint8_t now_values[NUM_PORTS];
+        read_pin_set(pins, now_values);
+        if (memcmp(now_values, values, NUM_PORTS) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void multi_wait(uint8_t opcode, void *params) {
+    struct pin_set *pins = params;
+    uint8_t xor_levels[NUM_PORTS];
+    uint8_t values[NUM_PORTS];
+    bool all = start_multi_wait(opcode, params, xor_levels);
+    if (debounce_active) {
+        while ((read_debounced_pin_wait(pins, xor_levels, values) != 0) == all && running) {}
+    } else {
+        while (running) {
+            if (all) {
+                while (read_pin_wait(pins, xor_levels, values) != 0 && running) {}
+            } else {
+                while (read_pin_wait(pins, xor_levels, values) == 0 && running) {}
+            }
+            // with a wait time set by wt, start again if the pins don't then hold steady for it
+            if (!steady_wait_time_half_us || pins_steady(pins, values)) {
+                break;
+            }
+        }
+    }
+    if (!all && running) {
+        report_multi_wait(params, xor_levels, values);
+    }
 }
 
-void noop(void *params) {
+void read_analog(void *params) {
+    uint8_t pin_number = *(uint8_t *) params;
+    ADC_MUX(pin_number);
+    SET_BIT_HI(ADCSRA, ADSC); // start ADC conversion
+    while (GET_BIT(ADCSRA, ADSC)) {} // wait for the conversion to end
+    write_result(RESULT_ANALOG, ADC, 2);
+    usb_serial_end_result();
 }
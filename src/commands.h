@@ -8,33 +8,200 @@
 #ifndef commands_h
 #define commands_h
 
-typedef void (*command_t)(void *);
-
-void undebounced_wait_high(void *params);
-void undebounced_wait_low(void *params);
-void undebounced_wait_change(void *params);
-void wait_high(void *params);
-void wait_low(void *params);
-void wait_change(void *params);
+#include "pins.h"
+
+// Program steps are stored as packed bytecode: an opcode byte followed by the
+// step's operands, whose size depends on the opcode (see OPERAND_SIZES in
+// interpreter.c). Steps are dispatched by a switch in the interpreter's run
+// loop; keep the values dense so that the switch compiles to a jump table.
+typedef enum {
+    OP_UNDEBOUNCED_WAIT_HIGH,
+    OP_UNDEBOUNCED_WAIT_LOW,
+    OP_UNDEBOUNCED_WAIT_CHANGE,
+    OP_WAIT_HIGH,
+    OP_WAIT_LOW,
+    OP_WAIT_CHANGE,
+    OP_SET_WAIT_TIME,
+    OP_DELAY_MILLISECONDS,
+    OP_DELAY_MICROSECONDS,
+    OP_TIMER_BEGIN,
+    OP_TIMER_END,
+    OP_PWM8,
+    OP_PWM16,
+    OP_SET_HIGH,
+    OP_SET_LOW,
+    OP_SET_TRISTATE,
+    OP_READ_DIGITAL,
+    OP_READ_ANALOG,
+    OP_CHAR_RECEIVE,
+    OP_CHAR_TRANSMIT,
+    OP_CHAR_GOTO,
+    OP_LOOP,
+    OP_GOTO,
+    OP_NOOP,
+    OP_HARDWARE_PULSE,
+    OP_HARDWARE_PULSE_WAIT,
+    OP_INPUT_CAPTURE_BEGIN,
+    OP_INPUT_CAPTURE_END,
+    OP_LOGIC_BEGIN,
+    OP_LOGIC_END,
+    OP_MARK,
+    OP_WAIT_UNTIL,
+    OP_WAIT_NEXT,
+    OP_TIMER_LAP,
+    OP_TIMER_READ,
+    OP_SEQUENCE,
+    OP_MULTI_SET_HIGH,
+    OP_MULTI_SET_LOW,
+    OP_MULTI_READ,
+    OP_WAIT_ALL,
+    OP_WAIT_PATTERN,
+    OP_WAIT_ANY,
+    OP_WAIT_ANY_CHANGE,
+    OP_COUNT_BEGIN,
+    OP_COUNT_END,
+    OP_COUNT_READ,
+    OP_COUNT_ZERO,
+    OP_COUNT_FREQUENCY,
+    // Fused steps, produced from the above when programming ends; see fuse_program().
+    // A fused step reads the operands of the steps it replaces, which follow
+    // it unaltered so they remain valid jump targets.
+    OP_PULSE_HIGH, // sh, du, sh/sl
+    OP_PULSE_LOW, // sl, du, sh/sl
+    OP_SET_HIGH_THEN_WAIT, // sh, wait
+    OP_SET_LOW_THEN_WAIT // sl, wait
+} opcode_t;
+
+// Offsets into the operands of a fused pulse step: those of its first set
+// step, then the du and second set steps it replaces, each an opcode and its
+// operands.
+#define PULSE_DELAY_OPERAND (sizeof(struct resolved_pin) + 1)
+#define PULSE_SECOND_OPCODE (PULSE_DELAY_OPERAND + sizeof(uint16_t))
+#define PULSE_SECOND_PIN_OPERAND (PULSE_SECOND_OPCODE + 1)
+#define PULSE_OPERANDS (PULSE_SECOND_PIN_OPERAND + sizeof(struct resolved_pin))
+
+// Tag bytes that start each result record in binary output mode. The value
+// follows, little-endian: 1 byte for digital reads, 2 for analog reads and
+// the dropped-capture count, and 4 for timer values and capture intervals.
+#define RESULT_DIGITAL 'd'
+#define RESULT_ANALOG 'a'
+#define RESULT_TIMER 't'
+#define RESULT_INTERVAL 'i'
+#define RESULT_DROPPED 'x'
+#define RESULT_LOGIC_HEADER 'r' // sample period in µs, then capacity in runs
+#define RESULT_LOGIC_RUN 'l' // 1-byte pin levels, then 2-byte run length in samples
+#define RESULT_LOGIC_FULL 'f' // no value
+#define RESULT_LAP 'p' // 1-byte timer index, then 4-byte µs
+#define RESULT_PINS 'm' // 4-byte levels of the pins read by mr, or that ended a wo or wx wait
+#define RESULT_TRACE 'e' // 2-byte step index, 2-char step and pin names, then 4-byte µs
+#define RESULT_COUNT 'c' // 4-byte edge count
+#define RESULT_FREQUENCY 'h' // 4-byte Hz
+
+void write_result(uint8_t tag, uint32_t value, uint8_t size);
+
+#define NUM_TIMERS 4 // for tb, te and tl
+#define LAP_LOG_SIZE 32 // tl results held until tr
+
+#define DEFAULT_WAIT_TIME_HALF_US 20 // 10 µs
+extern uint16_t steady_wait_time_half_us; // for debounced waits, as set by wt
+
+// The waits are given the step after them (NULL at the end of the program) and
+// return the number of steps from there that were executed on their behalf by
+// an edge interrupt, which the interpreter must then skip.
+uint8_t undebounced_wait_high(void *params, uint8_t *next_step, void *next_params);
+uint8_t undebounced_wait_low(void *params, uint8_t *next_step, void *next_params);
+uint8_t undebounced_wait_change(void *params, uint8_t *next_step, void *next_params);
+uint8_t wait_high(void *params, uint8_t *next_step, void *next_params);
+uint8_t wait_low(void *params, uint8_t *next_step, void *next_params);
+uint8_t wait_change(void *params, uint8_t *next_step, void *next_params);
 void set_wait_time(void *params);
 void delay_milliseconds(void *params);
 void delay_microseconds(void *params);
 void timer_begin(void *params);
 void timer_end(void *params);
+void timer_lap(void *params);
+void timer_read(void *params);
+void clear_lap_log(void);
 void pwm8(void *params);
 void pwm16(void *params);
-void set_high(void *params);
-void set_low(void *params);
-void set_tristate(void *params);
 void read_digital(void *params);
 void read_analog(void *params);
 void char_receive(void *params);
+uint8_t char_goto(void);
 void char_transmit(void *params);
-void char_goto(void *params);
-void loop(void *params);
-void goto_(void *params);
-void noop(void *params);
+void hardware_pulse(void *params);
+void hardware_pulse_wait(void *params);
+void input_capture_begin(void *params);
+void input_capture_end(void *params);
+void logic_begin(void *params);
+void logic_end(void *params);
+void count_begin(void *params);
+void count_end(void *params);
+void count_read(void *params);
+void count_zero(void *params);
+void count_frequency(void *params);
+void write_frequency(uint32_t count, uint16_t gate_ms);
+void wait_until(uint32_t deadline);
+void mark(void *params);
+void wait_until_offset(void *params);
+void wait_next(void *params);
+void multi_set_high(void *params);
+void multi_set_low(void *params);
+void multi_read(void *params);
+bool start_multi_wait(uint8_t opcode, void *params, uint8_t *xor_levels);
+void report_multi_wait(void *params, const uint8_t *xor_levels, const uint8_t *values);
+void multi_wait(uint8_t opcode, void *params);
+void pulse(void *params, bool first_high, bool second_high);
+uint8_t run_wait(uint8_t opcode, void *params, uint8_t *next_step, void *next_params);
 
+// The operands of the wa, wp and wo steps: the pins, and the level each is
+// waited for. The wx step has only the pins.
+struct pin_wait {
+    struct pin_set pins;
+    uint8_t levels[NUM_PORTS];
+};
 
-#endif /* commands_h */
+// Read the pins of a multi-pin wait, with the ports read as close together as
+// possible, into values (masked to the pins). Returns the bits of the pins
+// that differ from xor_levels (as set up by start_multi_wait()), over all
+// the ports ORed together: so zero if none do.
+static inline uint8_t read_pin_wait(const struct pin_set *pins, const uint8_t *xor_levels, uint8_t *values) {
+    values[0] = PINB & pins->masks[0];
+    values[1] = PINC & pins->masks[1];
+    values[2] = PIND & pins->masks[2];
+    values[3] = PINE & pins->masks[3];
+    values[4] = PINF & pins->masks[4];
+    return (values[0] ^ xor_levels[0]) | (values[1] ^ xor_levels[1]) | (values[2] ^ xor_levels[2]) |
+        (values[3] ^ xor_levels[3]) | (values[4] ^ xor_levels[4]);
+}
+
+// The set commands are short enough that they are defined inline, so that the
+// interpreter's dispatch loop doesn't pay for a call and register save.
+static inline void set_high(void *params) {
+    struct resolved_pin *pin = params;
+    if (pin->pwm_pin != NO_PWM) {
+        DISABLE_PWM(pin->pwm_pin);
+    }
+    SET_RESOLVED_HIGH(pin, DDR); // set pin for output
+    SET_RESOLVED_HIGH(pin, PORT); // set pin for output
+}
 
+static inline void set_low(void *params) {
+    struct resolved_pin *pin = params;
+    if (pin->pwm_pin != NO_PWM) {
+        DISABLE_PWM(pin->pwm_pin);
+    }
+    SET_RESOLVED_HIGH(pin, DDR); // set pin for output
+    SET_RESOLVED_LOW(pin, PORT); // set pin for output
+}
+
+static inline void set_tristate(void *params) {
+    struct resolved_pin *pin = params;
+    if (pin->pwm_pin != NO_PWM) {
+        DISABLE_PWM(pin->pwm_pin);
+    }
+    SET_RESOLVED_LOW(pin, DDR); // set pin for input
+    SET_RESOLVED_LOW(pin, PORT); // disable pullup resistor
+}
+
+#endif /* commands_h */
@@ -0,0 +1,138 @@
+// Copyright 2014 Zachary Pincus (zpincus@wustl.edu / zplab.wustl.edu)
+// This file is part of IOTool.
+//
+// IOTool is free software; you can redistribute it and/or modify
+// it under the terms of version 2 of the GNU General Public License as
+// published by the Free Software Foundation.
+
+#include <avr/interrupt.h>
+#include "counter.h"
+#include "capture.h"
+#include "interpreter.h"
+
+volatile bool counter_active[NUM_COUNTERS] = {false, false};
+volatile uint32_t timer0_overflows; // upper 24 bits of the Timer0 count; Timer1's are timer1_overflows in capture.c
+uint32_t final_counts[NUM_COUNTERS]; // once stopped, the timers go back to PWM, so their counts are kept here
+uint8_t counter_saved_tccr0a;
+uint8_t counter_saved_tccr1a;
+
+// Clock-select bits for an external clock, which are the same for both timers:
+// CSn2 and CSn1 for falling edges, and CSn0 as well for rising edges.
+#define EXTERNAL_CLOCK(_EDGE) (BIT(CS02) | BIT(CS01) | ((_EDGE) == COUNT_RISING ? BIT(CS00) : 0))
+
+ISR(TIMER0_OVF_vect) {
+    timer0_overflows++;
+}
+
+uint8_t counter_for_pin(uint8_t pin_number) {
+    if (PIN_PTR(pin_number, pin) != &PIND) {
+        return NO_COUNTER;
+    }
+    if (PIN_BYTE(pin_number, pin_mask) == BIT(PORTD7)) {
+        return COUNTER_T0;
+    }
+    if (PIN_BYTE(pin_number, pin_mask) == BIT(PORTD6)) {
+        return COUNTER_T1;
+    }
+    return NO_COUNTER;
+}
+
+void counter_start(uint8_t pin_number, uint8_t edge) {
+    uint8_t counter = counter_for_pin(pin_number);
+    counter_stop(counter); // restart from zero, perhaps counting the other edge
+    if (PIN_PTR(pin_number, ocr) != NULL) {
+        DISABLE_PWM(pin_number); // D7 is also Timer4's OC4D
+    }
+    SET_PIN_LOW(pin_number, ddr); // set pin for input
+    SET_PIN_HIGH(pin_number, port); // enable pullup resistor
+    if (counter == COUNTER_T0) {
+        counter_saved_tccr0a = TCCR0A; // retain which PWM outputs are connected
+        TIMSK0 = 0;
+        TCCR0B = 0; // stop Timer0
+        TCCR0A = 0; // normal mode, with 8-bit PWM on B7 and D0 suspended
+        timer0_overflows = 0;
+        TCNT0 = 0;
+        TIFR0 = BIT(TOV0); // clear pending flags
+        TIMSK0 = BIT(TOIE0);
+        counter_active[COUNTER_T0] = true;
+        TCCR0B = EXTERNAL_CLOCK(edge); // go
+    } else {
+        stop_pulse_train(); // Timer1 can't do these at the same time
+        input_capture_stop();
+        counter_saved_tccr1a = TCCR1A;
+        TIMSK1 = 0;
+        TCCR1B = 0; // stop Timer1
+        TCCR1A = 0; // normal mode; 10-bit PWM is suspended
+        timer1_overflows = 0;
+        TCNT1 = 0;
+        TIFR1 = BIT(TOV1);
+        TIMSK1 = BIT(TOIE1);
+        counter_active[COUNTER_T1] = true;
+        TCCR1B = EXTERNAL_CLOCK(edge);
+    }
+}
+
+void counter_stop(uint8_t counter) {
+    if (!counter_active[counter]) {
+        return;
+    }
+    final_counts[counter] = counter_read(counter);
+    if (counter == COUNTER_T0) {
+        TIMSK0 = 0;
+        TCCR0B = 0; // stop the clock and restore 8-bit PWM
+        TCCR0A = counter_saved_tccr0a;
+        TCNT0 = 0;
+        TCCR0B = BIT(CS00);
+    } else {
+        TIMSK1 = 0;
+        TCCR1B = TIMER1_PWM_MODE; // stop the clock and restore 10-bit PWM
+        TCCR1A = counter_saved_tccr1a;
+        ICR1 = PWM16_MAX;
+        TCNT1 = 0;
+        TCCR1B = TIMER1_PWM_MODE | BIT(CS10);
+    }
+    counter_active[counter] = false;
+}
+
+uint32_t counter_read(uint8_t counter) {
+    if (!counter_active[counter]) {
+        return final_counts[counter];
+    }
+    uint32_t count;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (counter == COUNTER_T0) {
+            uint8_t low = TCNT0;
+            uint32_t high = timer0_overflows;
+            if (GET_BIT(TIFR0, TOV0) && low < 0x80) {
+                high++; // the count has wrapped, but the interrupt hasn't run yet
+            }
+            count = (high << 8) | low;
+        } else {
+            uint16_t low = TCNT1;
+            uint16_t high = timer1_overflows;
+            if (GET_BIT(TIFR1, TOV1) && low < 0x8000) {
+                high++;
+            }
+            count = ((uint32_t) high << 16) | low;
+        }
+    }
+    return count;
+}
+
+void counter_zero(uint8_t counter) {
+    final_counts[counter] = 0;
+    if (!counter_active[counter]) {
+        return;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (counter == COUNTER_T0) {
+            TCNT0 = 0;
+            timer0_overflows = 0;
+            TIFR0 = BIT(TOV0);
+        } else {
+            TCNT1 = 0;
+            timer1_overflows = 0;
+            TIFR1 = BIT(TOV1);
+        }
+    }
+}
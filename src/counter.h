@@ -0,0 +1,33 @@
+// Copyright 2014 Zachary Pincus (zpincus@wustl.edu / zplab.wustl.edu)
+// This file is part of IOTool.
+//
+// IOTool is free software; you can redistribute it and/or modify
+// it under the terms of version 2 of the GNU General Public License as
+// published by the Free Software Foundation.
+
+#ifndef counter_h
+#define counter_h
+
+#include "pins.h"
+
+// Edge counters: Timer0 or Timer1 is clocked by the edges on its external
+// clock input (T0, pin D7; or T1, pin D6), so edges are counted by the timer
+// hardware with no CPU time spent per edge. An overflow ISR extends the count
+// to 32 bits. While counting, Timer0 can't generate 8-bit PWM on B7 and D0,
+// and Timer1 can't generate 10-bit PWM, pulse trains or input captures.
+#define COUNTER_T0 0
+#define COUNTER_T1 1
+#define NUM_COUNTERS 2
+#define NO_COUNTER 0xFF
+
+typedef enum {COUNT_RISING, COUNT_FALLING} count_edge_t;
+
+extern volatile bool counter_active[NUM_COUNTERS];
+
+uint8_t counter_for_pin(uint8_t pin_number); // NO_COUNTER if the pin is not a timer's clock input
+void counter_start(uint8_t pin_number, uint8_t edge); // a count_edge_t
+void counter_stop(uint8_t counter);
+uint32_t counter_read(uint8_t counter); // while counting, or the final count once stopped
+void counter_zero(uint8_t counter);
+
+#endif /* counter_h */
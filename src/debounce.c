@@ -0,0 +1,112 @@
+// Copyright 2014 Zachary Pincus (zpincus@wustl.edu / zplab.wustl.edu)
+// This file is part of IOTool.
+//
+// IOTool is free software; you can redistribute it and/or modify
+// it under the terms of version 2 of the GNU General Public License as
+// published by the Free Software Foundation.
+
+#include <avr/interrupt.h>
+#include <util/delay.h>
+#include "debounce.h"
+#include "interpreter.h"
+
+volatile bool debounce_active = false;
+volatile uint8_t debounced_ports[NUM_PORTS];
+uint16_t debounce_period; // in Timer3 ticks
+
+// Vertical counters: bit i of count_low[port] and count_high[port] together
+// count the samples in a row in which pin i of the port has differed from its
+// debounced level, so all eight pins of a port are counted at once with a
+// few logic operations. The count is cleared by any sample that agrees with
+// the debounced level, and the level flips on the fourth that doesn't.
+uint8_t count_low[NUM_PORTS];
+uint8_t count_high[NUM_PORTS];
+
+ISR(TIMER3_COMPA_vect) {
+    uint16_t due = OCR3A;
+    if ((uint16_t) (TCNT3 - due) >= debounce_period) {
+        // held off for a whole period, so that due + period has passed too and
+        // wouldn't match again until the timer wraps
+        SET_TIMER3_COMPARE(OCR3A, debounce_period);
+    } else {
+        OCR3A = due + debounce_period; // fire again in one period (wraparound expected; works great)
+    }
+    uint8_t samples[NUM_PORTS] = {PINB, PINC, PIND, PINE, PINF};
+    for (uint8_t port = 0; port < NUM_PORTS; port++) {
+        uint8_t low = count_low[port];
+        uint8_t high = count_high[port];
+        uint8_t differ = samples[port] ^ debounced_ports[port];
+        debounced_ports[port] ^= differ & low & high; // a count of 3, and this sample differs too
+        count_high[port] = (high ^ low) & differ;
+        count_low[port] = ~low & differ;
+    }
+}
+
+void debounce_start(uint16_t period_us) {
+    SET_MASK_LO(TIMSK3, BIT(OCIE3A));
+    debounce_period = period_us * 2;
+    debounced_ports[0] = PINB;
+    debounced_ports[1] = PINC;
+    debounced_ports[2] = PIND;
+    debounced_ports[3] = PINE;
+    debounced_ports[4] = PINF;
+    for (uint8_t port = 0; port < NUM_PORTS; port++) {
+        count_low[port] = 0;
+        count_high[port] = 0;
+    }
+    SET_TIMER3_COMPARE(OCR3A, debounce_period);
+    TIFR3 = BIT(OCF3A); // clear any timer-match flags present
+    SET_MASK_HI(TIMSK3, BIT(OCIE3A));
+    debounce_active = true;
+}
+
+void debounce_stop(void) {
+    SET_MASK_LO(TIMSK3, BIT(OCIE3A));
+    debounce_active = false;
+}
+
+// Restart the debounced levels of the given pins of each port from the levels
+// they read now.
+static void restart_debounced(const uint8_t *masks) {
+    _delay_us(1); // for pins just released to their pull-ups to rise
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        uint8_t samples[NUM_PORTS] = {PINB, PINC, PIND, PINE, PINF};
+        for (uint8_t port = 0; port < NUM_PORTS; port++) {
+            uint8_t mask = masks[port];
+            debounced_ports[port] = (debounced_ports[port] & ~mask) | (samples[port] & mask);
+            count_low[port] &= ~mask;
+            count_high[port] &= ~mask;
+        }
+    }
+}
+
+void set_debounced_input(const struct resolved_pin *pin) {
+    uint8_t changed = (RESOLVED_DDR(pin) | ~RESOLVED_PORT(pin)) & pin->mask; // not already a pulled-up input
+    SET_RESOLVED_LOW(pin, DDR); // set pin for input
+    SET_RESOLVED_HIGH(pin, PORT); // enable pullup resistor
+    if (debounce_active && changed) {
+        uint8_t masks[NUM_PORTS] = {0, 0, 0, 0, 0};
+        masks[PORT_INDEX(pin->pin_reg)] = changed;
+        restart_debounced(masks);
+    }
+}
+
+void set_debounced_inputs(const struct pin_set *set) {
+    uint8_t changed[NUM_PORTS];
+    uint8_t any = 0;
+    for (uint8_t port = 0; port < NUM_PORTS; port++) {
+        volatile uint8_t *pin_reg = &PINB + 3*port;
+        changed[port] = (pin_reg[1] | ~pin_reg[2]) & set->masks[port];
+        any |= changed[port];
+    }
+    set_pin_set_inputs(set);
+    if (debounce_active && any) {
+        restart_debounced(changed);
+    }
+}
+
+void read_debounced_pin_set(const struct pin_set *set, uint8_t *values) {
+    for (uint8_t port = 0; port < NUM_PORTS; port++) {
+        values[port] = debounced_ports[port] & set->masks[port];
+    }
+}
@@ -0,0 +1,51 @@
+// Copyright 2014 Zachary Pincus (zpincus@wustl.edu / zplab.wustl.edu)
+// This file is part of IOTool.
+//
+// IOTool is free software; you can redistribute it and/or modify
+// it under the terms of version 2 of the GNU General Public License as
+// published by the Free Software Foundation.
+
+#ifndef debounce_h
+#define debounce_h
+
+#include "pins.h"
+
+// Background debouncing: while it is on, a Timer3 compare-match ISR samples
+// every port at a fixed period, and keeps a debounced copy of each port's
+// levels, in which a pin only changes once it has read the other level for
+// DEBOUNCE_SAMPLES samples in a row. The debounced waits and reads then use
+// that copy instead of waiting out the wt time themselves.
+#define DEBOUNCE_SAMPLES 4
+#define MIN_DEBOUNCE_PERIOD 100 // µs; the ISR takes several µs
+#define MAX_DEBOUNCE_PERIOD 0x7FFF // µs, so that the period fits in 16 bits of Timer3 counts
+
+extern volatile bool debounce_active;
+extern volatile uint8_t debounced_ports[NUM_PORTS]; // as read from PINx for each port in a pin_set
+
+void debounce_start(uint16_t period_us);
+void debounce_stop(void);
+void read_debounced_pin_set(const struct pin_set *set, uint8_t *values);
+
+// Make a pin, or the pins of a set, inputs with pull-ups, as the debounced
+// steps do. While debouncing, the debounced level of a pin that wasn't
+// already one restarts from the level it reads then, as until then the
+// debouncer has been sampling whatever the pin was driven to.
+void set_debounced_input(const struct resolved_pin *pin);
+void set_debounced_inputs(const struct pin_set *set);
+
+// The debounced level of a pin; nonzero if high.
+static inline uint8_t get_debounced(const struct resolved_pin *pin) {
+    return debounced_ports[PORT_INDEX(pin->pin_reg)] & pin->mask;
+}
+
+// As read_pin_wait() (see commands.h), from the debounced levels.
+static inline uint8_t read_debounced_pin_wait(const struct pin_set *pins, const uint8_t *xor_levels, uint8_t *values) {
+    uint8_t differ = 0;
+    for (uint8_t port = 0; port < NUM_PORTS; port++) {
+        values[port] = debounced_ports[port] & pins->masks[port];
+        differ |= values[port] ^ xor_levels[port];
+    }
+    return differ;
+}
+
+#endif /* debounce_h */
@@ -0,0 +1,175 @@
+// Copyright 2014 Zachary Pincus (zpincus@wustl.edu / zplab.wustl.edu)
+// This file is part of IOTool.
+//
+// IOTool is free software; you can redistribute it and/or modify
+// it under the terms of version 2 of the GNU General Public License as
+// published by the Free Software Foundation.
+
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include "edge_wait.h"
+#include "interpreter.h"
+#include "commands.h"
+
+// A pin write to be done by the interrupt, as *port = (*port & and_mask) | or_mask
+struct pin_write {
+    uint8_t port; // data-space address of the PORTx register
+    uint8_t and_mask;
+    uint8_t or_mask;
+};
+
+struct follow_on {
+    uint8_t steps; // number of program steps executed by the interrupt; 0 if none
+    bool pulse; // if true, wait half_us_delay after the first write and then do the second
+    struct pin_write first;
+    uint16_t half_us_delay;
+    struct pin_write second;
+};
+
+volatile bool edge_wait_done;
+struct resolved_pin edge_wait_pin;
+uint8_t edge_wait_target;
+struct follow_on follow_on;
+
+#define WRITE_PIN(_WRITE) { volatile uint8_t *port = (volatile uint8_t *)(uintptr_t) (_WRITE).port;\
+                            *port = (*port & (_WRITE).and_mask) | (_WRITE).or_mask; }
+
+ISR(INT0_vect) {
+    if ((GET_RESOLVED(&edge_wait_pin) != 0) != edge_wait_target) {
+        return; // a pin change in the wrong direction
+    }
+    if (follow_on.steps) {
+        WRITE_PIN(follow_on.first);
+        if (follow_on.pulse) {
+            // timed with OCR3B as pulse() does, so the whole 16-bit range of delays works
+            if (follow_on.half_us_delay) { // a compare set to TCNT3 itself would only match after a full wrap
+                SET_TIMER3_COMPARE(OCR3B, follow_on.half_us_delay);
+                TIFR3 = BIT(OCF3B); // clear any timer-match flags present
+                while (!GET_BIT(TIFR3, OCF3B)) {}
+            }
+            WRITE_PIN(follow_on.second);
+        }
+    }
+    EIMSK = 0;
+    PCICR = 0;
+    edge_wait_done = true;
+}
+
+ISR(INT1_vect, ISR_ALIASOF(INT0_vect));
+ISR(INT2_vect, ISR_ALIASOF(INT0_vect));
+ISR(INT3_vect, ISR_ALIASOF(INT0_vect));
+ISR(INT6_vect, ISR_ALIASOF(INT0_vect));
+ISR(PCINT0_vect, ISR_ALIASOF(INT0_vect));
+
+// Set up a write for a set-high or set-low step, if its pin is already an
+// output with PWM disconnected, so that the write alone is equivalent.
+bool prepare_pin_write(struct pin_write *write, uint8_t opcode, struct resolved_pin *pin) {
+    if (!GET_MASK(RESOLVED_DDR(pin), pin->mask)) {
+        return false;
+    }
+    if (pin->pwm_pin != NO_PWM && GET_MASK(*PIN_REG(pin->pwm_pin, tccr), PIN_BYTE(pin->pwm_pin, tccr_mask))) {
+        return false;
+    }
+    write->port = pin->pin_reg + 2;
+    if (opcode == OP_SET_HIGH) {
+        write->and_mask = 0xFF;
+        write->or_mask = pin->mask;
+    } else {
+        write->and_mask = ~pin->mask;
+        write->or_mask = 0;
+    }
+    return true;
+}
+
+void prepare_follow_on(uint8_t *next_step, uint8_t *next_params) {
+    follow_on.steps = 0;
+    if (next_step == NULL) {
+        return;
+    }
+    switch (*next_step) {
+        case OP_SET_HIGH:
+        case OP_SET_HIGH_THEN_WAIT: // the wait step is left for the interpreter
+            if (prepare_pin_write(&follow_on.first, OP_SET_HIGH, (struct resolved_pin *) next_params)) {
+                follow_on.steps = 1;
+                follow_on.pulse = false;
+            }
+            break;
+        case OP_SET_LOW:
+        case OP_SET_LOW_THEN_WAIT:
+            if (prepare_pin_write(&follow_on.first, OP_SET_LOW, (struct resolved_pin *) next_params)) {
+                follow_on.steps = 1;
+                follow_on.pulse = false;
+            }
+            break;
+        case OP_PULSE_HIGH:
+        case OP_PULSE_LOW:
+            if (prepare_pin_write(&follow_on.first, *next_step == OP_PULSE_HIGH ? OP_SET_HIGH : OP_SET_LOW,
+                                  (struct resolved_pin *) next_params) &&
+                prepare_pin_write(&follow_on.second, next_params[PULSE_SECOND_OPCODE],
+                                  (struct resolved_pin *) (next_params + PULSE_SECOND_PIN_OPERAND))) {
+                follow_on.half_us_delay = *(uint16_t *) (next_params + PULSE_DELAY_OPERAND);
+                follow_on.steps = 3;
+                follow_on.pulse = true;
+            }
+            break;
+    }
+}
+
+// Returns false if the pin has no interrupt.
+bool arm_edge_interrupt(struct resolved_pin *pin, uint8_t target) {
+    if (pin->pin_reg == (uint8_t)(uintptr_t) &PINB) {
+        // PCINT0-7 are on port B, and fire on any change
+        PCMSK0 = pin->mask;
+        PCIFR = BIT(PCIF0);
+        PCICR = BIT(PCIE0);
+        return true;
+    }
+    // INT0-3 are on bits 0-3 of port D, and INT6 on bit 6 of port E. Each has
+    // two interrupt-sense bits: 11 for a rising edge, 10 for a falling edge.
+    uint8_t sense = target ? (BIT(ISC00) | BIT(ISC01)) : BIT(ISC01);
+    if (pin->pin_reg == (uint8_t)(uintptr_t) &PIND && pin->mask <= BIT(3)) {
+        uint8_t sense_mask = BIT(ISC00) | BIT(ISC01);
+        for (uint8_t bit = pin->mask; bit > 1; bit >>= 1) {
+            sense <<= 2;
+            sense_mask <<= 2;
+        }
+        SET_MASKED_BITS(EICRA, sense_mask, sense);
+    } else if (pin->pin_reg == (uint8_t)(uintptr_t) &PINE && pin->mask == BIT(6)) {
+        SET_MASKED_BITS(EICRB, BIT(ISC60) | BIT(ISC61), sense << ISC60);
+    } else {
+        return false;
+    }
+    EIFR = pin->mask; // changing the sense can set the interrupt flag
+    EIMSK = pin->mask;
+    return true;
+}
+
+uint8_t edge_wait(struct resolved_pin *pin, uint8_t target, uint8_t *next_step, void *next_params) {
+    edge_wait_pin = *pin;
+    edge_wait_target = target;
+    edge_wait_done = false;
+    prepare_follow_on(next_step, next_params);
+    if (!arm_edge_interrupt(pin, target)) {
+        return EDGE_WAIT_UNAVAILABLE;
+    }
+    set_sleep_mode(SLEEP_MODE_IDLE);
+    for (;;) {
+        cli();
+        if (edge_wait_done || !running) {
+            break;
+        }
+        if ((GET_RESOLVED(pin) != 0) == target) {
+            // already at the target level (perhaps it got there before the interrupt was armed)
+            follow_on.steps = 0;
+            break;
+        }
+        sleep_enable();
+        sei(); // the instruction after sei is guaranteed to run before any interrupt, so we can't miss a wakeup
+        sleep_cpu();
+        sleep_disable();
+    }
+    EIMSK = 0;
+    PCICR = 0;
+    sei();
+    return edge_wait_done ? follow_on.steps : 0;
+}
@@ -0,0 +1,24 @@
+// Copyright 2014 Zachary Pincus (zpincus@wustl.edu / zplab.wustl.edu)
+// This file is part of IOTool.
+//
+// IOTool is free software; you can redistribute it and/or modify
+// it under the terms of version 2 of the GNU General Public License as
+// published by the Free Software Foundation.
+
+#ifndef edge_wait_h
+#define edge_wait_h
+
+#include "pins.h"
+
+#define EDGE_WAIT_UNAVAILABLE 0xFF
+
+// Wait for a pin to read the target level (0 or 1) by sleeping until an
+// external interrupt (INT0-3, INT6) or pin-change interrupt (PCINT0-7) fires.
+// If next_step is not NULL and is a step that starts by setting a pin that is
+// already configured for output, the interrupt executes that step itself, for
+// a fixed latency from the edge. Returns the number of program steps executed
+// that way (zero if none), or EDGE_WAIT_UNAVAILABLE if the pin has no
+// interrupt, in which case the caller must poll.
+uint8_t edge_wait(struct resolved_pin *pin, uint8_t target, uint8_t *next_step, void *next_params);
+
+#endif /* edge_wait_h */
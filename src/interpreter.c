@@ -12,22 +12,31 @@
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
 #include <avr/wdt.h>
+#include <util/crc16.h>
+#include <avr/eeprom.h>
 #include "interpreter.h"
 #include "usb_serial.h"
 #include "pins.h"
 #include "commands.h"
+#include "capture.h"
+#include "debounce.h"
+#include "counter.h"
 
 
 volatile bool run_serial_tasks_from_isr = false;
 volatile bool running;
-volatile uint16_t ms_timer = 0;
-volatile uint16_t ms_timer_target;
-volatile bool ms_timer_done;
+volatile uint16_t timebase_overflows = 0;
+uint32_t timebase_mark; // set when each run of the program starts, and by mk and wn
+bool binary_output = false;
 
-#define PWM16_MAX (uint16_t) (1<<10)-1
-#define MAX_PROGRAM_STEPS 256
-#define HEAP_PER_STEP 3
-#define MAX_LOOP_COMMANDS 10
+#define PROGRAM_BYTES 512
+#define MAX_OPERANDS 11 // the largest of OPERAND_SIZES
+#define MAX_LOOP_COMMANDS 16
+#define MAX_PULSE_COMMANDS 8
+#define MIN_PULSE_GAP_US 50 // between pulses of a train, for the compare ISR to count each one and stop after the last
+#define MAX_LOGIC_COMMANDS 2
+#define MAX_SEQUENCES 4 // run concurrently; see run_sequences()
+#define PROGRAM_SLOTS 4 // of EEPROM, for saved programs
 
 #define AVCC_ADMUX BIT(REFS0)
 #define AREF_ADMUX 0
@@ -36,39 +45,130 @@ const char ECHO_OFF_PSTR[] PROGMEM = "\x80\xff";
 #define PROMPT '>'
 
 
-command_t program[MAX_PROGRAM_STEPS];
-uint8_t program_heap[MAX_PROGRAM_STEPS*HEAP_PER_STEP];
-uint16_t program_size = 0; // must be uint16 to be able to hold the value of 256, indicating that program is full
-uint8_t program_counter;
+// Packed bytecode: opcode_t values, each followed by its operands. There is
+// room past the end for one more step, which is where steps run in immediate
+// mode are put, and where each step is parsed before it is added.
+uint8_t program[PROGRAM_BYTES + 1 + MAX_OPERANDS];
+uint16_t program_size = 0; // in bytes
 uint16_t loop_current_values[MAX_LOOP_COMMANDS];
 uint16_t loop_initial_values[MAX_LOOP_COMMANDS];
 bool loop_active[MAX_LOOP_COMMANDS];
 uint8_t num_loop_commands = 0;
-typedef enum {IMMEDIATE, ON_RUN} mode_t;
+struct pulse_train pulse_trains[MAX_PULSE_COMMANDS];
+struct logic_config logic_configs[MAX_LOGIC_COMMANDS];
+uint8_t num_pulse_commands = 0;
+uint8_t num_logic_commands = 0;
+volatile uint16_t pulses_remaining;
+volatile uint8_t pulse_train_pin;
+volatile bool pulse_train_active = false;
+uint16_t sequence_starts[MAX_SEQUENCES]; // byte offset of the first step of each sequence
+uint8_t num_sequences = 1; // the program before the first sq step is the first sequence
+uint16_t program_crc = 0; // CRC-16/XMODEM of the program's steps as sent, one per line
+typedef enum {IMMEDIATE, ON_RUN, STAGING} mode_t;
 mode_t execute_mode = IMMEDIATE;
 
-ISR(TIMER3_COMPA_vect) {
-    ms_timer++; // add one ms
-    if (ms_timer == ms_timer_target) {
-        ms_timer_done = true;
+// A staged program is built after the stored program, in the rest of program[]
+// and of the lo, hp and lb tables, while the stored program goes on running;
+// swap_program() then moves it into place. Its table indices are those of the
+// entries it was given after the stored program's, until then.
+uint16_t staged_size = 0; // in bytes
+uint8_t staged_loop_commands = 0;
+uint8_t staged_pulse_commands = 0;
+uint8_t staged_logic_commands = 0;
+uint8_t staged_sequences = 1;
+uint16_t staged_crc = 0;
+bool staged_ready = false; // staging has ended, so the staged program can be swapped in
+volatile bool swap_pending = false; // swap at the start of the next iteration of the run
+// During a run, the USB ISR acts on the lines that stage a program as soon as
+// they arrive, rather than leaving them until the run ends like other input.
+volatile bool staging_from_isr = false;
+bool line_deferred; // a line not for staging is waiting for the run to end
+#define MAX_STAGING_BYTES 64 // taken in by each run of the USB ISR: one USB packet
+
+bool is_staging_line(const char *line);
+void interpret_line(char *line);
+void swap_program(void);
+
+ISR(TIMER3_OVF_vect) {
+    timebase_overflows++;
+}
+
+uint32_t timebase_now(void) {
+    uint16_t low;
+    uint16_t high;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        low = TCNT3;
+        high = timebase_overflows;
+        if (GET_BIT(TIFR3, TOV3) && low < 0x8000) {
+            high++; // the count has wrapped, but the interrupt hasn't run yet
+        }
+    }
+    return ((uint32_t) high << 16) | low;
+}
+
+static inline void end_pulse_train(void) {
+    DISABLE_PWM(pulse_train_pin); // pin reverts to its PORT value, which is low
+    TIMSK1 = 0;
+    TCCR1B = TIMER1_PWM_MODE; // stop the clock and restore 10-bit PWM
+    ICR1 = PWM16_MAX;
+    TCNT1 = 0;
+    TCCR1B = TIMER1_PWM_MODE | BIT(CS10);
+    pulse_train_active = false;
+}
+
+void stop_pulse_train(void) {
+    if (pulse_train_active) {
+        end_pulse_train();
+    }
+}
+
+// Fires after the falling edge of each hardware pulse, on whichever Timer1
+// channel is generating the pulse train.
+ISR(TIMER1_COMPA_vect) {
+    pulses_remaining--;
+    if (pulses_remaining == 0) {
+        end_pulse_train();
     }
-    OCR3A += 2000; // fire ISR again in 1 ms (wraparound expected; works great)
 }
 
+ISR(TIMER1_COMPB_vect, ISR_ALIASOF(TIMER1_COMPA_vect));
+
+// Interrupts are enabled once the next firing is scheduled, so that the
+// edge-wait interrupts can preempt USB handling and keep their latency fixed.
+// Updating OCR3C first, with interrupts still off, keeps the other Timer3
+// ISRs from corrupting it through the shared 16-bit TEMP register.
 ISR(TIMER3_COMPC_vect) {
     uint8_t data;
-    if (run_serial_tasks_from_isr && usb_serial_has_byte(&data)) {
-        if (data == QUIT_BYTE) {
-            running = false;
-        } else {
+    OCR3C += 30000; // fire ISR again in 15 ms (wraparound expected; works great)
+    sei();
+    if (run_serial_tasks_from_isr && !usb_serial_output_busy) {
+        usb_serial_send_buffered(); // send any results held back by the "buffer" setting
+        // take in one byte, to look for the quit byte; or, while lines to stage are arriving, all of them
+        for (uint8_t i = 0; i < MAX_STAGING_BYTES && usb_serial_has_byte(&data); i++) {
+            if (data == QUIT_BYTE) {
+                running = false;
+                break;
+            }
             usb_serial_process_byte(data);
+            if (!staging_from_isr || line_deferred) {
+                break;
+            }
+            char *line = usb_serial_peek_line();
+            if (line != NULL) {
+                if (!is_staging_line(line)) {
+                    line_deferred = true;
+                    break;
+                }
+                interpret_line(line); // no prompt is written, as the run's output continues
+                usb_serial_discard_line();
+            }
         }
     }
     USB_USBTask();
-    OCR3C += 30000; // fire ISR again in 15 ms (wraparound expected; works great)
 }
 
 void interpreter_init(void) {
+    pins_init();
 
     // Timer/Counter0
     TCCR0A = BIT(WGM00) | BIT(WGM01); // Fast 8-bit PWM (freq=62.5 kHz), no outputs connected
@@ -77,7 +177,7 @@ void interpreter_init(void) {
 
     // Timer/Counter1
     TCCR1A = BIT(WGM11); // set WGM to mode 14: fast PWM; TOP of counter defined by ICR1
-    TCCR1B = BIT(WGM13) | BIT(WGM12);
+    TCCR1B = TIMER1_PWM_MODE;
     ICR1 = PWM16_MAX;
     TIMSK1 = 0;// no interrupts
     TCCR1B |= BIT(CS10); // start clock, no prescaling (freq=16 MHz, period=62.5 ns)
@@ -86,7 +186,7 @@ void interpreter_init(void) {
     // USB must be initialized before this function is called, as the below turns on the USB-handling ISR
     TCCR3A = 0; // Normal mode
     OCR3C = 0; // fire off USB timer right away once enabled
-    TIMSK3 = USB_TIMER_MASK; // interrupt on OCR3C for usb tasks (we'll use OCR3A and OCR3B for millisecond and microsecond timing)
+    TIMSK3 = USB_TIMER_MASK | TIMEBASE_MASK; // interrupt on OCR3C for usb tasks, and on overflow for the timebase (OCR3B is for microsecond timing)
     TIFR3 = 0; // make sure no interrupts are queued
     TCCR3B = TIMER3_ENABLE; // start clock, prescaler=8 (freq=2 MHz, period=0.5 microseconds)
 
@@ -108,30 +208,609 @@ void interpreter_init(void) {
 }
 
 
+void discard_staged_program(void) {
+    staged_size = 0;
+    staged_crc = 0;
+    staged_loop_commands = 0;
+    staged_pulse_commands = 0;
+    staged_logic_commands = 0;
+    staged_sequences = 1;
+    staged_ready = false;
+    swap_pending = false;
+}
+
 void clear_program(void) {
     program_size = 0;
+    program_crc = 0;
     num_loop_commands = 0;
+    num_pulse_commands = 0;
+    num_logic_commands = 0;
+    num_sequences = 1;
+    discard_staged_program();
+    trace_discard(); // the trace refers to steps by their place in the old program
+}
+
+// Return the device to the state it starts up in, without the watchdog reboot
+// of the "reset" command (which makes the host wait for USB to re-enumerate).
+void soft_reset(void) {
+    stop_pulse_train();
+    input_capture_stop();
+    logic_capture_stop();
+    logic_record = NULL;
+    for (uint8_t i = 0; i < NUM_COUNTERS; i++) {
+        counter_stop(i);
+        counter_zero(i);
+    }
+    for (uint8_t i = 0; i < NUM_PINS; i++) {
+        struct resolved_pin pin;
+        resolve_pin(i, &pin);
+        set_tristate(&pin); // also disconnects PWM
+    }
+    TIMSK3 = USB_TIMER_MASK | TIMEBASE_MASK; // disable the µs timer interrupt used by stream
+    TIFR3 = BIT(OCF3B); // and clear any pending compare match
+    steady_wait_time_half_us = DEFAULT_WAIT_TIME_HALF_US;
+    ADMUX = AVCC_ADMUX;
+    usb_serial_echo = true;
+    usb_serial_flush_threshold = 0;
+    binary_output = false;
+    for (uint8_t i = 0; i < MAX_LOOP_COMMANDS; i++) {
+        loop_active[i] = false;
+    }
+    debounce_stop();
+    clear_lap_log();
+    trace_enabled = false;
+    clear_program(); // which also discards the trace
+    execute_mode = IMMEDIATE;
+}
+
+// Size in bytes of the operands that follow each opcode in the program.
+#define PIN_OPERANDS sizeof(struct resolved_pin)
+#define JUMP_OPERANDS 4 // byte offset of the target step, then its index (kept for listing and relinking)
+#define LOOP_OPERANDS 5 // as for a jump, then the index into the loop tables
+#define PIN_SET_OPERANDS sizeof(struct pin_set)
+#define PIN_WAIT_OPERANDS sizeof(struct pin_wait)
+const uint8_t OPERAND_SIZES[] PROGMEM = {
+    PIN_OPERANDS, PIN_OPERANDS, PIN_OPERANDS, PIN_OPERANDS, PIN_OPERANDS, PIN_OPERANDS, // waits
+    2, 2, 2, // wt, dm, du
+    1, 1, // tb, te: timer index
+    2, 3, // pm (8 bit, 16 bit): pin number, then value
+    PIN_OPERANDS, PIN_OPERANDS, PIN_OPERANDS, PIN_OPERANDS, // sh, sl, st, rd
+    1, // ra: pin number
+    0, 1, 0, // cr, ct, cg
+    LOOP_OPERANDS, JUMP_OPERANDS, // lo, go
+    0, // no
+    2, 0, // hp (pin number, then index into pulse_trains), hw
+    1, 0, // ib, ie
+    1, 0, // lb (index into logic_configs), le
+    0, 4, 4, // mk, wu, wn: half-microseconds
+    1, 0, // tl (timer index), tr
+    0, // sq
+    PIN_SET_OPERANDS, PIN_SET_OPERANDS, PIN_SET_OPERANDS, // mh, ml, mr
+    PIN_WAIT_OPERANDS, PIN_WAIT_OPERANDS, PIN_WAIT_OPERANDS, PIN_SET_OPERANDS, // wa, wp, wo, wx
+    2, 1, 1, 1, 3, // kb (pin number, then edge), ke, kr, kz (pin number), kf (pin number, then ms)
+    PIN_OPERANDS, PIN_OPERANDS, PIN_OPERANDS, PIN_OPERANDS // fused steps: only the head's own operands
+};
+
+static inline uint8_t operand_size(uint8_t opcode) {
+    return pgm_read_byte(OPERAND_SIZES + opcode);
+}
+
+// the step after the given one, not accounting for fused steps
+static inline uint8_t *next_step(uint8_t *step) {
+    return step + 1 + operand_size(*step);
+}
+
+uint8_t *skip_steps(uint8_t *step, uint8_t count) {
+    while (count--) {
+        step = next_step(step);
+    }
+    return step;
+}
+
+// byte offset of the step with the given index, or of the end of the program if there is no such step
+uint16_t step_offset(uint16_t index) {
+    uint8_t *step = program;
+    uint8_t *end = program + program_size;
+    while (index-- && step < end) {
+        step = next_step(step);
+    }
+    return step < end ? step - program : program_size;
+}
+
+// Whether a lo step should jump back again. Each lo step has its own count,
+// which is reset from its initial value when the loop is entered afresh.
+static inline bool loop_again(uint8_t loop_index) {
+    if (!loop_active[loop_index]) {
+        // Initialize loop variables if we're not already in this particular loop.
+        // This allows for nested loops to work properly.
+        loop_current_values[loop_index] = loop_initial_values[loop_index];
+        loop_active[loop_index] = true;
+    }
+    if (loop_current_values[loop_index] > 0) {
+        loop_current_values[loop_index]--;
+        return true;
+    }
+    loop_active[loop_index] = false;
+    return false;
+}
+
+// Execute the program steps from the byte offset first_step up to (but not
+// including) end_step, following any jumps. All dispatch happens in this one
+// function, with the current step and its operands kept in local pointers:
+// the common commands are executed inline, and only the slower ones are
+// called out to. Each case moves step past its own operands, so the common
+// steps don't pay for a lookup of their size.
+void execute_steps(uint16_t first_step, uint16_t end_step) {
+    uint8_t *step = program + first_step;
+    uint8_t *end = program + end_step;
+    uint8_t *params;
+    uint8_t skip;
+    while (running && step < end) {
+        uint8_t *executed = step;
+        uint8_t opcode = *step;
+        params = step + 1;
+        switch (opcode) {
+            case OP_SET_HIGH:
+                set_high(params);
+                step = params + PIN_OPERANDS;
+                break;
+            case OP_SET_LOW:
+                set_low(params);
+                step = params + PIN_OPERANDS;
+                break;
+            case OP_SET_TRISTATE:
+                set_tristate(params);
+                step = params + PIN_OPERANDS;
+                break;
+            case OP_NOOP:
+                step = params;
+                break;
+            case OP_GOTO:
+                step = program + *(uint16_t *) params;
+                break;
+            case OP_LOOP:
+                if (loop_again(params[4])) {
+                    step = program + *(uint16_t *) params;
+                } else {
+                    step = params + LOOP_OPERANDS;
+                }
+                break;
+            case OP_MULTI_SET_HIGH:
+                multi_set_high(params);
+                step = params + PIN_SET_OPERANDS;
+                break;
+            case OP_MULTI_SET_LOW:
+                multi_set_low(params);
+                step = params + PIN_SET_OPERANDS;
+                break;
+            case OP_MULTI_READ:
+                multi_read(params);
+                step = params + PIN_SET_OPERANDS;
+                break;
+            case OP_WAIT_ALL:
+            case OP_WAIT_PATTERN:
+            case OP_WAIT_ANY:
+                multi_wait(opcode, params);
+                step = params + PIN_WAIT_OPERANDS;
+                break;
+            case OP_WAIT_ANY_CHANGE:
+                multi_wait(opcode, params);
+                step = params + PIN_SET_OPERANDS;
+                break;
+            case OP_SEQUENCE:
+                return; // the end of the sequence; only reached with a single sequence, or in immediate mode
+            case OP_CHAR_GOTO:
+                step = program + step_offset(char_goto());
+                break;
+            case OP_UNDEBOUNCED_WAIT_HIGH:
+            case OP_UNDEBOUNCED_WAIT_LOW:
+            case OP_UNDEBOUNCED_WAIT_CHANGE:
+            case OP_WAIT_HIGH:
+            case OP_WAIT_LOW:
+            case OP_WAIT_CHANGE:
+                step = params + PIN_OPERANDS;
+                skip = run_wait(opcode, params, step < end ? step : NULL, step + 1);
+                step = skip_steps(step, skip); // skip any steps run by the edge interrupt
+                break;
+            case OP_SET_WAIT_TIME:
+                set_wait_time(params);
+                step = params + 2;
+                break;
+            case OP_DELAY_MILLISECONDS:
+                delay_milliseconds(params);
+                step = params + 2;
+                break;
+            case OP_DELAY_MICROSECONDS:
+                delay_microseconds(params);
+                step = params + 2;
+                break;
+            case OP_TIMER_BEGIN:
+                timer_begin(params);
+                step = params + 1;
+                break;
+            case OP_TIMER_END:
+                timer_end(params);
+                step = params + 1;
+                break;
+            case OP_TIMER_LAP:
+                timer_lap(params);
+                step = params + 1;
+                break;
+            case OP_TIMER_READ:
+                timer_read(params);
+                step = params;
+                break;
+            case OP_PWM8:
+                pwm8(params);
+                step = params + 2;
+                break;
+            case OP_PWM16:
+                pwm16(params);
+                step = params + 3;
+                break;
+            case OP_READ_DIGITAL:
+                read_digital(params);
+                step = params + PIN_OPERANDS;
+                break;
+            case OP_READ_ANALOG:
+                read_analog(params);
+                step = params + 1;
+                break;
+            case OP_CHAR_RECEIVE:
+                char_receive(params);
+                step = params;
+                break;
+            case OP_CHAR_TRANSMIT:
+                char_transmit(params);
+                step = params + 1;
+                break;
+            case OP_HARDWARE_PULSE:
+                hardware_pulse(params);
+                step = params + 2;
+                break;
+            case OP_HARDWARE_PULSE_WAIT:
+                hardware_pulse_wait(params);
+                step = params;
+                break;
+            case OP_INPUT_CAPTURE_BEGIN:
+                input_capture_begin(params);
+                step = params + 1;
+                break;
+            case OP_INPUT_CAPTURE_END:
+                input_capture_end(params);
+                step = params;
+                break;
+            case OP_LOGIC_BEGIN:
+                logic_begin(params);
+                step = params + 1;
+                break;
+            case OP_LOGIC_END:
+                logic_end(params);
+                step = params;
+                break;
+            case OP_COUNT_BEGIN:
+                count_begin(params);
+                step = params + 2;
+                break;
+            case OP_COUNT_END:
+                count_end(params);
+                step = params + 1;
+                break;
+            case OP_COUNT_READ:
+                count_read(params);
+                step = params + 1;
+                break;
+            case OP_COUNT_ZERO:
+                count_zero(params);
+                step = params + 1;
+                break;
+            case OP_COUNT_FREQUENCY:
+                count_frequency(params);
+                step = params + 3;
+                break;
+            case OP_MARK:
+                mark(params);
+                step = params;
+                break;
+            case OP_WAIT_UNTIL:
+                wait_until_offset(params);
+                step = params + 4;
+                break;
+            case OP_WAIT_NEXT:
+                wait_next(params);
+                step = params + 4;
+                break;
+            case OP_PULSE_HIGH:
+            case OP_PULSE_LOW:
+                pulse(params, opcode == OP_PULSE_HIGH, params[PULSE_SECOND_OPCODE] == OP_SET_HIGH);
+                step = params + PULSE_OPERANDS; // skip the du and second set steps
+                break;
+            case OP_SET_HIGH_THEN_WAIT:
+            case OP_SET_LOW_THEN_WAIT:
+                if (opcode == OP_SET_HIGH_THEN_WAIT) {
+                    set_high(params);
+                } else {
+                    set_low(params);
+                }
+                step = params + PIN_OPERANDS; // the wait step
+                params = step + 1;
+                opcode = *step;
+                step = params + PIN_OPERANDS;
+                skip = run_wait(opcode, params, step < end ? step : NULL, step + 1);
+                step = skip_steps(step, skip); // skip any steps run by the edge interrupt
+                break;
+            default:
+                return; // can't happen, but would otherwise loop forever
+        }
+        if (trace_active) {
+            trace_step(executed - program); // fused steps are recorded as their first step
+        }
+    }
+}
+
+// Sequences: a program with sq steps is split into up to MAX_SEQUENCES
+// sequences, which run concurrently. Each has its own current step and mark
+// (for mk, wu and wn); each lo step already has its own count, so the loops of
+// different sequences don't interfere. The sequences are run round-robin, one
+// step of each in turn, so a sequence can be held up by at most one step of
+// each of the others. To allow this, the waits and delays don't block: each
+// time its turn comes, a waiting sequence checks whether it can go on, and if
+// not the next sequence runs. The edge interrupts of the waits are not used,
+// and fused steps are run as their component steps. The cr and cg steps still
+// block all of the sequences until a character is received.
+typedef enum {SEQUENCE_READY, SEQUENCE_WAITING, SEQUENCE_SETTLING, SEQUENCE_DONE} sequence_state_t;
+struct sequence {
+    uint16_t step; // byte offset of the current step
+    uint8_t state; // a sequence_state_t
+    uint8_t target; // the level awaited by the current wait step
+    uint32_t mark; // time of the last mk step, or the start of the run; advanced by wn
+    uint32_t deadline; // when the current delay ends, or when the current wait's pin will have settled
+    uint32_t count; // the edge count at the start of the current kf step's gate time
+    uint8_t levels[NUM_PORTS]; // the levels the current multi-pin wait compares the pins with
+};
+
+static inline bool deadline_passed(uint32_t deadline) {
+    return (int32_t) (timebase_now() - deadline) >= 0;
+}
+
+// Check, or start, the pin wait that is the sequence's current step. Returns
+// whether the wait is over.
+bool sequence_wait(struct sequence *sequence, uint8_t opcode, struct resolved_pin *pin) {
+    uint8_t kind = (opcode - OP_UNDEBOUNCED_WAIT_HIGH) % 3; // high, low or change
+    bool debounced = opcode >= OP_WAIT_HIGH;
+    bool background = debounced && debounce_active; // use the background debouncer's levels
+    if (sequence->state == SEQUENCE_READY) {
+        if (debounced) {
+            set_debounced_input(pin);
+        } else {
+            SET_RESOLVED_LOW(pin, DDR); // set pin for input
+            SET_RESOLVED_HIGH(pin, PORT); // enable pullup resistor
+        }
+        uint8_t level = background ? get_debounced(pin) : GET_RESOLVED(pin);
+        sequence->target = kind == 0 ? 1 : kind == 1 ? 0 : !level;
+        sequence->state = SEQUENCE_WAITING;
+    }
+    uint8_t level = background ? get_debounced(pin) : GET_RESOLVED(pin);
+    if ((level != 0) != sequence->target) {
+        sequence->state = SEQUENCE_WAITING; // if the pin changes, reset the settling time
+        return false;
+    }
+    if (!debounced || background || steady_wait_time_half_us == 0) {
+        return true;
+    }
+    if (sequence->state == SEQUENCE_WAITING) {
+        sequence->deadline = timebase_now() + steady_wait_time_half_us;
+        sequence->state = SEQUENCE_SETTLING;
+    }
+    return deadline_passed(sequence->deadline);
+}
+
+// As above, for the multi-pin waits. Debouncing here only requires that the
+// condition holds for the wait time, not that none of the pins change.
+bool sequence_multi_wait(struct sequence *sequence, uint8_t opcode, void *params) {
+    bool all = opcode == OP_WAIT_ALL || opcode == OP_WAIT_PATTERN;
+    if (sequence->state == SEQUENCE_READY) {
+        start_multi_wait(opcode, params, sequence->levels);
+        sequence->state = SEQUENCE_WAITING;
+    }
+    uint8_t values[NUM_PORTS];
+    bool differ = (debounce_active ? read_debounced_pin_wait(params, sequence->levels, values) :
+                                     read_pin_wait(params, sequence->levels, values)) != 0;
+    if (differ == all) {
+        sequence->state = SEQUENCE_WAITING; // reset the settling time
+        return false;
+    }
+    if (steady_wait_time_half_us && !debounce_active) {
+        if (sequence->state == SEQUENCE_WAITING) {
+            sequence->deadline = timebase_now() + steady_wait_time_half_us;
+            sequence->state = SEQUENCE_SETTLING;
+        }
+        if (!deadline_passed(sequence->deadline)) {
+            return false;
+        }
+    }
+    if (!all) {
+        report_multi_wait(params, sequence->levels, values);
+    }
+    return true;
+}
+
+// Run the current step of a sequence, or check on it if it is waiting.
+void run_sequence_step(struct sequence *sequence) {
+    uint8_t *step = program + sequence->step;
+    uint8_t opcode = *step;
+    uint8_t *params = step + 1;
+    switch (opcode) {
+        case OP_SEQUENCE:
+            sequence->state = SEQUENCE_DONE;
+            return;
+        case OP_GOTO:
+            step = program + *(uint16_t *) params;
+            break;
+        case OP_LOOP:
+            if (loop_again(params[4])) {
+                step = program + *(uint16_t *) params;
+            } else {
+                step = params + LOOP_OPERANDS;
+            }
+            break;
+        case OP_CHAR_GOTO:
+            step = program + step_offset(char_goto());
+            break;
+        case OP_UNDEBOUNCED_WAIT_HIGH:
+        case OP_UNDEBOUNCED_WAIT_LOW:
+        case OP_UNDEBOUNCED_WAIT_CHANGE:
+        case OP_WAIT_HIGH:
+        case OP_WAIT_LOW:
+        case OP_WAIT_CHANGE:
+            if (!sequence_wait(sequence, opcode, (struct resolved_pin *) params)) {
+                return;
+            }
+            step = params + PIN_OPERANDS;
+            break;
+        case OP_WAIT_ALL:
+        case OP_WAIT_PATTERN:
+        case OP_WAIT_ANY:
+        case OP_WAIT_ANY_CHANGE:
+            if (!sequence_multi_wait(sequence, opcode, params)) {
+                return;
+            }
+            step = next_step(step);
+            break;
+        case OP_DELAY_MILLISECONDS:
+        case OP_DELAY_MICROSECONDS:
+        case OP_WAIT_UNTIL:
+        case OP_WAIT_NEXT:
+            if (sequence->state == SEQUENCE_READY) {
+                if (opcode == OP_DELAY_MILLISECONDS) {
+                    sequence->deadline = timebase_now() + (uint32_t) *(uint16_t *) params * 2000;
+                } else if (opcode == OP_DELAY_MICROSECONDS) {
+                    sequence->deadline = timebase_now() + *(uint16_t *) params;
+                } else if (opcode == OP_WAIT_UNTIL) {
+                    sequence->deadline = sequence->mark + *(uint32_t *) params;
+                } else {
+                    sequence->mark += *(uint32_t *) params;
+                    sequence->deadline = sequence->mark;
+                }
+                sequence->state = SEQUENCE_WAITING;
+            }
+            if (!deadline_passed(sequence->deadline)) {
+                return;
+            }
+            step = next_step(step);
+            break;
+        case OP_HARDWARE_PULSE_WAIT:
+            if (pulse_train_active) {
+                return;
+            }
+            step = params;
+            break;
+        case OP_COUNT_FREQUENCY:
+            if (sequence->state == SEQUENCE_READY) {
+                sequence->count = counter_read(counter_for_pin(params[0]));
+                sequence->deadline = timebase_now() + (uint32_t) *(uint16_t *) (params + 1) * 2000;
+                sequence->state = SEQUENCE_WAITING;
+            }
+            if (!deadline_passed(sequence->deadline)) {
+                return;
+            }
+            write_frequency(counter_read(counter_for_pin(params[0])) - sequence->count, *(uint16_t *) (params + 1));
+            step = params + 3;
+            break;
+        case OP_MARK:
+            sequence->mark = timebase_now();
+            step = params;
+            break;
+        case OP_PULSE_HIGH:
+        case OP_SET_HIGH_THEN_WAIT:
+            set_high(params);
+            step = params + PIN_OPERANDS;
+            break;
+        case OP_PULSE_LOW:
+        case OP_SET_LOW_THEN_WAIT:
+            set_low(params);
+            step = params + PIN_OPERANDS;
+            break;
+        default: {
+            // the step doesn't wait or jump, so can be run on its own by the usual dispatch (which also traces it)
+            uint16_t next = sequence->step + 1 + operand_size(opcode);
+            execute_steps(sequence->step, next);
+            sequence->step = next;
+            sequence->state = next < program_size ? SEQUENCE_READY : SEQUENCE_DONE;
+            return;
+        }
+    }
+    if (trace_active) {
+        trace_step(sequence->step);
+    }
+    sequence->step = step - program;
+    sequence->state = sequence->step < program_size ? SEQUENCE_READY : SEQUENCE_DONE;
+}
+
+// Run all the sequences of the program until the first one ends (or the
+// program is stopped); the others may go on forever, so are stopped then.
+void run_sequences(void) {
+    struct sequence sequences[MAX_SEQUENCES];
+    for (uint8_t i = 0; i < num_sequences; i++) {
+        sequences[i].step = sequence_starts[i];
+        sequences[i].state = sequence_starts[i] < program_size ? SEQUENCE_READY : SEQUENCE_DONE;
+        sequences[i].mark = timebase_mark;
+    }
+    while (running && sequences[0].state != SEQUENCE_DONE) {
+        for (uint8_t i = 0; i < num_sequences; i++) {
+            if (sequences[i].state != SEQUENCE_DONE) {
+                run_sequence_step(sequences + i);
+            }
+        }
+    }
+}
+
+// Swap in the staged program if a swap was asked for during the run. The USB
+// ISR, which may be staging, is held off while the swap is checked and done.
+static inline void swap_if_pending(void) {
+    if (!swap_pending) {
+        return;
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        SET_MASK_LO(TIMSK3, USB_TIMER_MASK);
+    }
+    if (swap_pending) { // the ISR may have discarded the staged program just before
+        swap_program();
+    }
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        SET_MASK_HI(TIMSK3, USB_TIMER_MASK);
+    }
 }
 
 void run_program(uint16_t num_iters) {
+    if (trace_enabled) {
+        trace_start();
+    }
     running = true;
+    line_deferred = false;
+    staging_from_isr = true;
     run_serial_tasks_from_isr = true;
     for (uint16_t i = 0; i < num_iters; i++) {
-        program_counter = 0;
         if (!running) {
             break;
         }
+        swap_if_pending();
         for (int l = 0; l < num_loop_commands; l++) {
             loop_active[l] = false;
         }
-        while (running && program_counter < program_size) {
-            uint8_t current_pc = program_counter;
-            program_counter++; // increment first to allow functions to manipulate the PC.
-            program[current_pc](program_heap + current_pc*HEAP_PER_STEP);
+        timebase_mark = timebase_now();
+        if (num_sequences > 1) {
+            run_sequences();
+        } else {
+            execute_steps(0, program_size);
         }
     }
+    trace_active = false;
     running = false;
     run_serial_tasks_from_isr = false;
+    staging_from_isr = false;
+    swap_if_pending(); // asked for during the last iteration
+    usb_serial_flush();
 }
 
 
@@ -156,27 +835,47 @@ bool parse_uint16(char **in, uint16_t max, void *dst) {
     return true;
 }
 
+bool parse_uint32(char **in, uint32_t max, void *dst) {
+    char *old_in = *in;
+    unsigned long ulpin = strtoul(*in, in, 10);
+    if (errno || ulpin > max || old_in == *in) {
+        return false;
+    }
+    *(uint32_t *)dst = (uint32_t) ulpin;
+    return true;
+}
+
 bool parse_pin(char **in, void *dst) {
     char *in_ptr = *in;
-    while (*in_ptr != '\0') {
-        if (isspace(*in_ptr)) {
-            in_ptr++;
-        } else {
-            break;
-        }
+    while (isspace(*in_ptr)) {
+        in_ptr++;
     }
-    for (uint8_t i = 0; i < NUM_PINS; i++) {
-        if (in_ptr[0] == pins[i].name[0] && (pins[i].name[1] == '\0' || in_ptr[1] == pins[i].name[1])) {
-            *(uint8_t *)dst = i;
-            if (pins[i].name[1] == '\0') {
-                *in = in_ptr + 1;
-            } else {
-                *in = in_ptr + 2;
-            }
-            return true;
-        }
+    if (*in_ptr == '\0') {
+        return false;
     }
-    return false;
+    // try the longest name first
+    uint8_t length = (in_ptr[1] != '\0' && !isspace(in_ptr[1])) ? 2 : 1;
+    uint8_t pin_number = find_pin(in_ptr, length);
+    if (pin_number == NO_PIN && length == 2) {
+        length = 1;
+        pin_number = find_pin(in_ptr, length);
+    }
+    if (pin_number == NO_PIN) {
+        return false;
+    }
+    *(uint8_t *)dst = pin_number;
+    *in = in_ptr + length;
+    return true;
+}
+
+// parse a pin name and store it resolved to its registers, for the set/wait commands
+bool parse_resolved_pin(char **in, void *dst) {
+    uint8_t pin_number;
+    if (!parse_pin(in, &pin_number)) {
+        return false;
+    }
+    resolve_pin(pin_number, (struct resolved_pin *) dst);
+    return true;
 }
 
 bool parse_space_to_end(char *in) {
@@ -188,12 +887,38 @@ bool parse_space_to_end(char *in) {
     return true;
 }
 
-typedef enum {NOERR, BAD_FUNC, BAD_PARAM, NOT_PWM, NOT_ANALOG, NO_ROOM} err_t;
-typedef enum {PROGRAM, END, RUN, ADD_STEP, ECHO_OFF, RESET, AREF} input_action_t;
+// parse one or more pin names to the end of the line, and store them as a pin_set
+bool parse_pin_set(char **in, void *dst) {
+    struct pin_set *set = dst;
+    memset(set, 0, sizeof(struct pin_set));
+    uint8_t pin_number;
+    do {
+        if (!parse_pin(in, &pin_number)) {
+            return false;
+        }
+        add_to_pin_set(set, pin_number);
+    } while (!parse_space_to_end(*in));
+    return true;
+}
+
+typedef enum {NOERR, BAD_FUNC, BAD_PARAM, NOT_PWM, NOT_ANALOG, NOT_PULSE, NOT_COUNTER, NO_ROOM, BAD_CRC, TOO_BIG, NOT_SAVED, NOT_STAGED, TIMED_OUT} err_t;
+typedef enum {PROGRAM, END, RUN, ADD_STEP, ECHO_OFF, RESET, CLEAR, AREF, LIST, BUFFER, FORMAT, STREAM, UPLOAD, HASH, SAVE, LOAD, FREE, TRACE, TRACE_DUMP, DEBOUNCE, STAGE, SWAP} input_action_t;
 
 // forward decls for clarity
-err_t add_program_step(char *line, command_t *function_out);
+err_t add_program_step(char *line, uint8_t *opcode_out);
+err_t append_program_step(uint8_t opcode);
+void write_error(err_t error);
+void upload_program(uint16_t size, uint16_t expected_crc);
+uint16_t step_line_crc(uint16_t crc, const char *line);
+err_t save_program(uint8_t slot);
+err_t load_program(uint8_t slot);
+void fuse_program(void);
+void link_program(void);
+void list_program(void);
+void write_trace(void);
 void interpret_line(char *line);
+void soft_reset(void);
+void write_uint(uint16_t value);
 
 void interpreter_main() {
     usb_serial_write_byte(PROMPT);
@@ -213,6 +938,16 @@ void interpret_line(char *line) {
     input_action_t action;
     bool success = true;
     uint16_t num_iters = 0;
+    uint16_t flush_threshold = 0;
+    uint16_t debounce_period = 0;
+    bool binary = false;
+    bool trace = false;
+    uint16_t stream_rate = 0;
+    uint16_t upload_size = 0;
+    uint16_t upload_crc = 0;
+    uint8_t slot = 0;
+    uint8_t stream_channels[MAX_STREAM_CHANNELS];
+    uint8_t num_stream_channels = 0;
     uint8_t admux_val = AVCC_ADMUX;
     char *rest;
 
@@ -222,6 +957,12 @@ void interpret_line(char *line) {
     } else if (strncmp_P(line, PSTR("end"), 3) == 0) {
             action = END;
             rest = line+3;
+    } else if (strncmp_P(line, PSTR("stage"), 5) == 0) {
+        action = STAGE;
+        rest = line+5;
+    } else if (strncmp_P(line, PSTR("swap"), 4) == 0) {
+        action = SWAP;
+        rest = line+4;
     } else if (strncmp_P(line, PSTR("run"), 3) == 0) {
         action = RUN;
         num_iters = (uint16_t) strtoul(line+3, &rest, 10);
@@ -238,6 +979,72 @@ void interpret_line(char *line) {
     } else if (strncmp_P(line, PSTR("reset"), 5) == 0) {
         action = RESET;
         rest = line+5;
+    } else if (strncmp_P(line, PSTR("clear"), 5) == 0) {
+        action = CLEAR;
+        rest = line+5;
+    } else if (strncmp_P(line, PSTR("list"), 4) == 0) {
+        action = LIST;
+        rest = line+4;
+    } else if (strncmp_P(line, PSTR("buffer"), 6) == 0) {
+        action = BUFFER;
+        flush_threshold = (uint16_t) strtoul(line+6, &rest, 10);
+        if (errno || flush_threshold >= USB_OBUF) {
+            success = false;
+        }
+    } else if (strncmp_P(line, PSTR("debounce"), 8) == 0) {
+        action = DEBOUNCE;
+        rest = line+8;
+        success = parse_uint16(&rest, MAX_DEBOUNCE_PERIOD, &debounce_period) &&
+            (debounce_period == 0 || debounce_period >= MIN_DEBOUNCE_PERIOD);
+    } else if (strncmp_P(line, PSTR("upload"), 6) == 0) {
+        action = UPLOAD;
+        rest = line+6;
+        success = parse_uint16(&rest, 0xFFFF, &upload_size) && parse_uint16(&rest, 0xFFFF, &upload_crc);
+    } else if (strncmp_P(line, PSTR("hash"), 4) == 0) {
+        action = HASH;
+        rest = line+4;
+    } else if (strncmp_P(line, PSTR("trace on"), 8) == 0) {
+        action = TRACE;
+        trace = true;
+        rest = line+8;
+    } else if (strncmp_P(line, PSTR("trace off"), 9) == 0) {
+        action = TRACE;
+        trace = false;
+        rest = line+9;
+    } else if (strncmp_P(line, PSTR("trace dump"), 10) == 0) {
+        action = TRACE_DUMP;
+        rest = line+10;
+    } else if (strncmp_P(line, PSTR("free"), 4) == 0) {
+        action = FREE;
+        rest = line+4;
+    } else if (strncmp_P(line, PSTR("save"), 4) == 0) {
+        action = SAVE;
+        rest = line+4;
+        success = parse_uint8(&rest, PROGRAM_SLOTS-1, &slot);
+    } else if (strncmp_P(line, PSTR("load"), 4) == 0) {
+        action = LOAD;
+        rest = line+4;
+        success = parse_uint8(&rest, PROGRAM_SLOTS-1, &slot);
+    } else if (strncmp_P(line, PSTR("stream"), 6) == 0) {
+        action = STREAM;
+        rest = line+6;
+        success = parse_uint16(&rest, MAX_STREAM_SAMPLE_RATE, &stream_rate) && stream_rate >= MIN_STREAM_SAMPLE_RATE;
+        while (success && !parse_space_to_end(rest)) {
+            success = num_stream_channels < MAX_STREAM_CHANNELS &&
+                      parse_pin(&rest, stream_channels + num_stream_channels);
+            num_stream_channels++;
+        }
+        if (num_stream_channels == 0 || (uint32_t) stream_rate * num_stream_channels > MAX_STREAM_SAMPLE_RATE) {
+            success = false;
+        }
+    } else if (strncmp_P(line, PSTR("binary"), 6) == 0) {
+        action = FORMAT;
+        binary = true;
+        rest = line+6;
+    } else if (strncmp_P(line, PSTR("text"), 4) == 0) {
+        action = FORMAT;
+        binary = false;
+        rest = line+4;
     } else if (strncmp_P(line, PSTR("aref"), 4) == 0) {
         action = AREF;
         admux_val = AREF_ADMUX; // use ARef as the voltage ref
@@ -257,8 +1064,11 @@ void interpret_line(char *line) {
 
     switch (action) {
         err_t result;
-        command_t function;
+        uint8_t opcode;
         case RUN:
+            if (execute_mode == ON_RUN) {
+                link_program(); // a program run before "end" may have unlinked jumps
+            }
             run_program(num_iters);
             break;
         case PROGRAM:
@@ -266,8 +1076,39 @@ void interpret_line(char *line) {
             execute_mode = ON_RUN;
             break;
         case END:
+            if (execute_mode == ON_RUN) {
+                fuse_program();
+                link_program();
+            } else if (execute_mode == STAGING) {
+                staged_ready = true;
+            }
             execute_mode = IMMEDIATE;
             break;
+        case STAGE:
+            // end any programming first, unless the program is running (having been linked by "run")
+            if (execute_mode == ON_RUN && !staging_from_isr) {
+                fuse_program();
+                link_program();
+            }
+            discard_staged_program(); // and cancel any swap of it
+            execute_mode = STAGING;
+            break;
+        case SWAP:
+            if (execute_mode == STAGING) { // swapping ends staging
+                staged_ready = true;
+                execute_mode = IMMEDIATE;
+            }
+            if (!staged_ready) {
+                write_error(NOT_STAGED);
+            } else if (staging_from_isr) {
+                swap_pending = true; // see run_program()
+            } else {
+                swap_program();
+            }
+            break;
+        case LIST:
+            list_program();
+            break;
         case ECHO_OFF:
             if (!usb_serial_echo) {
                 // always echo back the magic echo-off characters even if echo is already off
@@ -282,50 +1123,477 @@ void interpret_line(char *line) {
         case RESET:
             wdt_enable(WDTO_15MS);
             break;
+        case CLEAR:
+            soft_reset();
+            break;
         case AREF:
             ADMUX = admux_val;
             break;
-        case ADD_STEP:
-            result = add_program_step(line, &function);
-            switch (result) {
-                case BAD_FUNC:
-                    usb_serial_write_string_P(PSTR("ERROR: Unknown function\n"));
-                    break;
-                case BAD_PARAM:
-                    usb_serial_write_string_P(PSTR("ERROR: Could not parse function parameters\n"));
-                    break;
-                case NOT_PWM:
-                    usb_serial_write_string_P(PSTR("ERROR: Specified pin is not PWM-enabled\n"));
-                    break;
-                case NOT_ANALOG:
+        case BUFFER:
+            usb_serial_flush_threshold = flush_threshold;
+            break;
+        case FORMAT:
+            binary_output = binary;
+            break;
+        case DEBOUNCE:
+            if (debounce_period) {
+                debounce_start(debounce_period);
+            } else {
+                debounce_stop();
+            }
+            break;
+        case HASH:
+            write_uint(program_crc);
+            usb_serial_write_byte('\n');
+            break;
+        case FREE:
+            // room left for steps, and in the tables of the lo, hp and lb steps
+            write_uint(PROGRAM_BYTES - program_size - staged_size);
+            write_uint(MAX_LOOP_COMMANDS - num_loop_commands - staged_loop_commands);
+            write_uint(MAX_PULSE_COMMANDS - num_pulse_commands - staged_pulse_commands);
+            write_uint(MAX_LOGIC_COMMANDS - num_logic_commands - staged_logic_commands);
+            usb_serial_write_byte('\n');
+            break;
+        case TRACE:
+            trace_enabled = trace;
+            break;
+        case TRACE_DUMP:
+            write_trace();
+            break;
+        case SAVE:
+            write_error(save_program(slot));
+            break;
+        case LOAD:
+            write_error(load_program(slot));
+            execute_mode = IMMEDIATE;
+            break;
+        case UPLOAD:
+            upload_program(upload_size, upload_crc);
+            execute_mode = IMMEDIATE;
+            break;
+        case STREAM:
+            for (uint8_t i = 0; i < num_stream_channels; i++) {
+                if (!PIN_BYTE(stream_channels[i], adc_mux_bits)) {
                     usb_serial_write_string_P(PSTR("ERROR: Specified pin cannot be used for analog input\n"));
-                    break;
-                case NO_ROOM:
-                    usb_serial_write_string_P(PSTR("ERROR: Too many function steps\n"));
-                    break;
-                case NOERR:
-                    if (execute_mode == IMMEDIATE){
-                        if (function != &loop && function != &goto_ && function != char_goto) {
-                            // don't run loops in immediate mode, duh.
-                            running = true;
-                            run_serial_tasks_from_isr = true;
-                            function(program_heap + program_size*HEAP_PER_STEP);
-                            run_serial_tasks_from_isr = false;
-                            running = false;
-                        }
-                    } else {
-                        program[program_size] = function;
-                        program_size++;
-                        if (function == &loop) {
-                            num_loop_commands++;
-                        }
-                    }
-                    break;
+                    return;
+                }
             }
+            adc_stream(stream_rate, stream_channels, num_stream_channels);
+            running = false;
+            break;
+        case ADD_STEP:
+            result = add_program_step(line, &opcode);
+            if (result != NOERR) {
+                write_error(result);
+            } else if (execute_mode == IMMEDIATE) {
+                if (opcode != OP_LOOP && opcode != OP_GOTO && opcode != OP_CHAR_GOTO) {
+                    // don't run loops in immediate mode, duh.
+                    // The step is run from the (unused) slot past the end of the program.
+                    uint16_t end = program_size + staged_size;
+                    program[end] = opcode;
+                    running = true;
+                    run_serial_tasks_from_isr = true;
+                    execute_steps(end, end + 1 + operand_size(opcode));
+                    run_serial_tasks_from_isr = false;
+                    running = false;
+                }
+            } else if ((result = append_program_step(opcode)) != NOERR) {
+                write_error(result);
+            } else if (execute_mode == STAGING) {
+                staged_crc = step_line_crc(staged_crc, line);
+            } else {
+                program_crc = step_line_crc(program_crc, line);
+            }
+            break;
+    }
+}
+
+// Store a step whose operands add_program_step() has already put after the
+// end of the program, if there is room. While staging, the step is added to
+// the staged program instead.
+err_t append_program_step(uint8_t opcode) {
+    uint16_t size = 1 + operand_size(opcode);
+    uint16_t end = program_size + staged_size;
+    if (end + size > PROGRAM_BYTES) {
+        return NO_ROOM;
     }
+    program[end] = opcode;
+    uint16_t *program_bytes = &program_size;
+    uint8_t *loops = &num_loop_commands;
+    uint8_t *pulses = &num_pulse_commands;
+    uint8_t *logic = &num_logic_commands;
+    uint8_t *sequences = &num_sequences;
+    if (execute_mode == STAGING) {
+        program_bytes = &staged_size;
+        loops = &staged_loop_commands;
+        pulses = &staged_pulse_commands;
+        logic = &staged_logic_commands;
+        sequences = &staged_sequences;
+    }
+    *program_bytes += size;
+    if (opcode == OP_LOOP) {
+        (*loops)++;
+    } else if (opcode == OP_HARDWARE_PULSE) {
+        (*pulses)++;
+    } else if (opcode == OP_LOGIC_BEGIN) {
+        (*logic)++;
+    } else if (opcode == OP_SEQUENCE) {
+        (*sequences)++;
+    }
+    return NOERR;
 }
 
-err_t add_program_step(char *line, command_t *function_out) {
+void write_error(err_t error) {
+    switch (error) {
+        case BAD_FUNC:
+            usb_serial_write_string_P(PSTR("ERROR: Unknown function\n"));
+            break;
+        case BAD_PARAM:
+            usb_serial_write_string_P(PSTR("ERROR: Could not parse function parameters\n"));
+            break;
+        case NOT_PWM:
+            usb_serial_write_string_P(PSTR("ERROR: Specified pin is not PWM-enabled\n"));
+            break;
+        case NOT_ANALOG:
+            usb_serial_write_string_P(PSTR("ERROR: Specified pin cannot be used for analog input\n"));
+            break;
+        case NOT_PULSE:
+            usb_serial_write_string_P(PSTR("ERROR: Specified pin cannot generate hardware pulses\n"));
+            break;
+        case NOT_COUNTER:
+            usb_serial_write_string_P(PSTR("ERROR: Specified pin cannot count edges\n"));
+            break;
+        case NO_ROOM:
+            usb_serial_write_string_P(PSTR("ERROR: Too many function steps\n"));
+            break;
+        case BAD_CRC:
+            usb_serial_write_string_P(PSTR("ERROR: Program upload failed checksum\n"));
+            break;
+        case TOO_BIG:
+            usb_serial_write_string_P(PSTR("ERROR: Program too large to save\n"));
+            break;
+        case NOT_SAVED:
+            usb_serial_write_string_P(PSTR("ERROR: No program saved in that slot\n"));
+            break;
+        case NOT_STAGED:
+            usb_serial_write_string_P(PSTR("ERROR: No program staged\n"));
+            break;
+        case TIMED_OUT:
+            usb_serial_write_string_P(PSTR("ERROR: Program upload timed out\n"));
+            break;
+        case NOERR:
+            break;
+    }
+}
+
+// Add a step, as the line it was sent on, to the checksum reported by "hash".
+// Each step is followed by '\n', however its line ended, and blank lines are
+// left out, so the checksum is the same whether the program was uploaded or
+// sent line by line.
+uint16_t step_line_crc(uint16_t crc, const char *line) {
+    for (; *line != '\0'; line++) {
+        crc = _crc_xmodem_update(crc, *line);
+    }
+    return _crc_xmodem_update(crc, '\n');
+}
+
+// Receive a whole program of size bytes in one transfer: the same steps as
+// would be sent between "program" and "end", one per line, with a
+// CRC-16/XMODEM checksum over all the bytes. Each line is added as it arrives,
+// but if any step is bad or the checksum doesn't match, the whole program is
+// discarded. Either way, the rest of the data is read, so the host can send it
+// all without waiting, and at most one error is reported.
+#define UPLOAD_BYTE_TIMEOUT 2000000UL // half-us: 1 s
+
+// Wait for the next byte of an upload, or give up if none comes in time, so a
+// host that sends short leaves the device waiting for commands again.
+static bool upload_byte(uint8_t *data) {
+#ifdef SIMULATOR
+    *data = usb_serial_wait_byte();
+    return true;
+#endif
+    uint32_t deadline = timebase_now() + UPLOAD_BYTE_TIMEOUT;
+    while (!usb_serial_has_byte(data)) {
+        if (deadline_passed(deadline)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void upload_program(uint16_t size, uint16_t expected_crc) {
+    char line[USB_IBUF];
+    uint16_t crc = 0; // of the data as sent, to check the transfer
+    uint16_t steps_crc = 0; // of the steps, for "hash"
+    uint8_t line_length = 0;
+    err_t result = NOERR;
+    clear_program();
+    usb_serial_flush();
+    while (size--) {
+        uint8_t data;
+        if (!upload_byte(&data)) {
+            result = TIMED_OUT;
+            break;
+        }
+        crc = _crc_xmodem_update(crc, data);
+        if (result != NOERR) {
+            continue;
+        }
+        if (data != '\n' && data != '\r') {
+            if (line_length == USB_IBUF - 1) {
+                result = BAD_PARAM;
+            } else {
+                line[line_length++] = data;
+            }
+            continue;
+        }
+        line[line_length] = '\0';
+        line_length = 0;
+        if (parse_space_to_end(line)) {
+            continue;
+        }
+        uint8_t opcode;
+        result = add_program_step(line, &opcode);
+        if (result == NOERR) {
+            result = append_program_step(opcode);
+            steps_crc = step_line_crc(steps_crc, line);
+        }
+    }
+    if (result == NOERR && crc != expected_crc) {
+        result = BAD_CRC;
+    }
+    if (result == NOERR && line_length > 0) {
+        result = BAD_PARAM; // the last line wasn't terminated
+    }
+    if (result == NOERR) {
+        fuse_program();
+        link_program();
+        program_crc = steps_crc;
+    } else {
+        clear_program();
+        write_error(result);
+    }
+}
+
+// How the parameters of each step are parsed and checked.
+typedef enum {
+    ARGS_NONE,
+    ARGS_SEQUENCE, // none, but there is a limit on the number of sq steps
+    ARGS_RESOLVED_PIN, // a pin, stored resolved to its registers
+    ARGS_PIN_SET, // one or more pins, stored as a pin_set
+    ARGS_PIN_LEVEL, // a level (0 or 1), then one or more pins, stored as a pin_wait
+    ARGS_PIN_PATTERN, // a uint32 of levels in the order of mr's result, then one or more pins, stored as a pin_wait
+    ARGS_ANALOG_PIN, // a pin with an ADC channel
+    ARGS_UINT8, // a uint8 no larger than the step's max
+    ARGS_OPTIONAL_UINT8, // as above, or 0 if not given
+    ARGS_UINT16, // a uint16 no larger than the step's max
+    ARGS_HALF_US, // a uint16 µs no larger than the step's max, stored in half-microseconds
+    ARGS_DEADLINE, // a uint32 µs less than 2^30, stored in half-microseconds
+    ARGS_PWM, // a PWM pin, and a value sized to its timer; chooses between OP_PWM8 and OP_PWM16
+    ARGS_JUMP, // a uint16 step index, linked to the step's byte offset when programming ends
+    ARGS_LOOP, // a jump, and a uint16 count stored in the loop tables
+    ARGS_PULSE, // a Timer1 PWM pin, and a width, period and count stored in pulse_trains
+    ARGS_LOGIC, // a uint8 divider and 1-8 pins, stored in logic_configs
+    ARGS_COUNTER, // a timer clock-input pin (D6 or D7), stored as its pin number
+    ARGS_COUNTER_EDGE, // as above, then an optional uint8 edge no larger than the step's max (0 if not given)
+    ARGS_COUNTER_GATE // as above, then a nonzero uint16 ms no larger than the step's max
+} args_t;
+
+struct step_syntax {
+    char name[2];
+    uint8_t opcode;
+    uint8_t args; // args_t
+    uint16_t max;
+};
+
+// Sorted by name, for binary search.
+const struct step_syntax STEP_SYNTAX[] PROGMEM = {
+    {"cg", OP_CHAR_GOTO, ARGS_NONE, 0},
+    {"cr", OP_CHAR_RECEIVE, ARGS_NONE, 0},
+    {"ct", OP_CHAR_TRANSMIT, ARGS_UINT8, 255},
+    {"dm", OP_DELAY_MILLISECONDS, ARGS_UINT16, 0xFFFF},
+    {"du", OP_DELAY_MICROSECONDS, ARGS_HALF_US, 0x7FFF},
+    {"go", OP_GOTO, ARGS_JUMP, 0},
+    {"hp", OP_HARDWARE_PULSE, ARGS_PULSE, 0},
+    {"hw", OP_HARDWARE_PULSE_WAIT, ARGS_NONE, 0},
+    {"ib", OP_INPUT_CAPTURE_BEGIN, ARGS_UINT8, CAPTURE_PERIODS},
+    {"ie", OP_INPUT_CAPTURE_END, ARGS_NONE, 0},
+    {"kb", OP_COUNT_BEGIN, ARGS_COUNTER_EDGE, COUNT_FALLING},
+    {"ke", OP_COUNT_END, ARGS_COUNTER, 0},
+    {"kf", OP_COUNT_FREQUENCY, ARGS_COUNTER_GATE, 0xFFFF},
+    {"kr", OP_COUNT_READ, ARGS_COUNTER, 0},
+    {"kz", OP_COUNT_ZERO, ARGS_COUNTER, 0},
+    {"lb", OP_LOGIC_BEGIN, ARGS_LOGIC, 0},
+    {"le", OP_LOGIC_END, ARGS_NONE, 0},
+    {"lo", OP_LOOP, ARGS_LOOP, 0},
+    {"mh", OP_MULTI_SET_HIGH, ARGS_PIN_SET, 0},
+    {"mk", OP_MARK, ARGS_NONE, 0},
+    {"ml", OP_MULTI_SET_LOW, ARGS_PIN_SET, 0},
+    {"mr", OP_MULTI_READ, ARGS_PIN_SET, 0},
+    {"no", OP_NOOP, ARGS_NONE, 0},
+    {"pm", OP_PWM8, ARGS_PWM, 0},
+    {"ra", OP_READ_ANALOG, ARGS_ANALOG_PIN, 0},
+    {"rd", OP_READ_DIGITAL, ARGS_RESOLVED_PIN, 0},
+    {"sh", OP_SET_HIGH, ARGS_RESOLVED_PIN, 0},
+    {"sl", OP_SET_LOW, ARGS_RESOLVED_PIN, 0},
+    {"sq", OP_SEQUENCE, ARGS_SEQUENCE, 0},
+    {"st", OP_SET_TRISTATE, ARGS_RESOLVED_PIN, 0},
+    {"tb", OP_TIMER_BEGIN, ARGS_OPTIONAL_UINT8, NUM_TIMERS-1},
+    {"te", OP_TIMER_END, ARGS_OPTIONAL_UINT8, NUM_TIMERS-1},
+    {"tl", OP_TIMER_LAP, ARGS_OPTIONAL_UINT8, NUM_TIMERS-1},
+    {"tr", OP_TIMER_READ, ARGS_NONE, 0},
+    {"uc", OP_UNDEBOUNCED_WAIT_CHANGE, ARGS_RESOLVED_PIN, 0},
+    {"uh", OP_UNDEBOUNCED_WAIT_HIGH, ARGS_RESOLVED_PIN, 0},
+    {"ul", OP_UNDEBOUNCED_WAIT_LOW, ARGS_RESOLVED_PIN, 0},
+    {"wa", OP_WAIT_ALL, ARGS_PIN_LEVEL, 0},
+    {"wc", OP_WAIT_CHANGE, ARGS_RESOLVED_PIN, 0},
+    {"wh", OP_WAIT_HIGH, ARGS_RESOLVED_PIN, 0},
+    {"wl", OP_WAIT_LOW, ARGS_RESOLVED_PIN, 0},
+    {"wn", OP_WAIT_NEXT, ARGS_DEADLINE, 0},
+    {"wo", OP_WAIT_ANY, ARGS_PIN_LEVEL, 0},
+    {"wp", OP_WAIT_PATTERN, ARGS_PIN_PATTERN, 0},
+    {"wt", OP_SET_WAIT_TIME, ARGS_HALF_US, 0x7FFF},
+    {"wu", OP_WAIT_UNTIL, ARGS_DEADLINE, 0},
+    {"wx", OP_WAIT_ANY_CHANGE, ARGS_PIN_SET, 0}
+};
+
+// copy the table entry for a two-character step name to dst; returns false if there is none
+bool find_step_syntax(const char *name, struct step_syntax *dst) {
+    uint16_t key = ((uint16_t) (uint8_t) name[0] << 8) | (uint8_t) name[1];
+    uint8_t low = 0;
+    uint8_t high = ARRAYLEN(STEP_SYNTAX);
+    while (low < high) {
+        uint8_t middle = (low + high) / 2;
+        uint16_t middle_key = ((uint16_t) pgm_read_byte(&STEP_SYNTAX[middle].name[0]) << 8) |
+                              pgm_read_byte(&STEP_SYNTAX[middle].name[1]);
+        if (key == middle_key) {
+            memcpy_P(dst, STEP_SYNTAX + middle, sizeof(struct step_syntax));
+            return true;
+        } else if (key < middle_key) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return false;
+}
+
+// Whether a line received during a run is one the USB ISR acts on at once:
+// stage or swap, or while staging, end or a step (or a blank line). Steps are
+// told from the other commands, which are all longer words, by their names.
+bool is_staging_line(const char *line) {
+    if (strncmp_P(line, PSTR("stage"), 5) == 0 || strncmp_P(line, PSTR("swap"), 4) == 0) {
+        return true;
+    }
+    if (execute_mode != STAGING) {
+        return false;
+    }
+    struct step_syntax syntax;
+    return strncmp_P(line, PSTR("end"), 3) == 0 || parse_space_to_end((char *) line) ||
+        (strlen(line) >= 2 && (line[2] == '\0' || isspace(line[2])) && find_step_syntax(line, &syntax));
+}
+
+// Programs are saved to EEPROM in fixed-size slots: a header, then the
+// program, then the side tables of the loop, pulse and logic steps. Resolved
+// pins are saved as register addresses, and steps as bytecode, so a slot can
+// only be loaded by the same firmware that saved it; the header's format and
+// opcode count guard against the bytecode or the set of opcodes having changed.
+#define PROGRAM_SLOT_SIZE 256
+#define PROGRAM_FORMAT 2 // increment when the bytecode changes
+#define NUM_OPCODES (OP_SET_LOW_THEN_WAIT + 1)
+#define NUM_PROGRAM_SECTIONS 4
+
+struct program_slot_header {
+    uint8_t format;
+    uint8_t num_opcodes;
+    uint16_t program_crc;
+    uint16_t image_crc; // of the sections that follow the header
+    uint16_t program_size;
+    uint8_t num_loop_commands;
+    uint8_t num_pulse_commands;
+    uint8_t num_logic_commands;
+};
+
+uint8_t EEMEM program_slots[PROGRAM_SLOTS][PROGRAM_SLOT_SIZE];
+
+// get the location and size in RAM of each part of the program that is saved
+uint16_t get_program_sections(uint8_t **starts, uint16_t *sizes) {
+    starts[0] = program;
+    sizes[0] = program_size;
+    starts[1] = (uint8_t *) loop_initial_values;
+    sizes[1] = num_loop_commands*sizeof(uint16_t);
+    starts[2] = (uint8_t *) pulse_trains;
+    sizes[2] = num_pulse_commands*sizeof(struct pulse_train);
+    starts[3] = (uint8_t *) logic_configs;
+    sizes[3] = num_logic_commands*sizeof(struct logic_config);
+    uint16_t total = 0;
+    for (uint8_t i = 0; i < NUM_PROGRAM_SECTIONS; i++) {
+        total += sizes[i];
+    }
+    return total;
+}
+
+uint16_t crc_block(uint16_t crc, const uint8_t *data, uint16_t size) {
+    while (size--) {
+        crc = _crc_xmodem_update(crc, *data++);
+    }
+    return crc;
+}
+
+err_t save_program(uint8_t slot) {
+    uint8_t *starts[NUM_PROGRAM_SECTIONS];
+    uint16_t sizes[NUM_PROGRAM_SECTIONS];
+    if (get_program_sections(starts, sizes) > PROGRAM_SLOT_SIZE - sizeof(struct program_slot_header)) {
+        return TOO_BIG;
+    }
+    struct program_slot_header header = {PROGRAM_FORMAT, NUM_OPCODES, program_crc, 0, program_size,
+        num_loop_commands, num_pulse_commands, num_logic_commands};
+    uint8_t *eeprom = program_slots[slot] + sizeof(header);
+    for (uint8_t i = 0; i < NUM_PROGRAM_SECTIONS; i++) {
+        eeprom_update_block(starts[i], eeprom, sizes[i]);
+        header.image_crc = crc_block(header.image_crc, starts[i], sizes[i]);
+        eeprom += sizes[i];
+    }
+    eeprom_update_block(&header, program_slots[slot], sizeof(header));
+    return NOERR;
+}
+
+err_t load_program(uint8_t slot) {
+    struct program_slot_header header;
+    eeprom_read_block(&header, program_slots[slot], sizeof(header));
+    clear_program();
+    if (header.format != PROGRAM_FORMAT || header.num_opcodes != NUM_OPCODES || header.program_size > PROGRAM_BYTES ||
+        header.num_loop_commands > MAX_LOOP_COMMANDS || header.num_pulse_commands > MAX_PULSE_COMMANDS ||
+        header.num_logic_commands > MAX_LOGIC_COMMANDS) {
+        return NOT_SAVED; // most likely, a never-written (all 0xFF) slot
+    }
+    program_size = header.program_size;
+    num_loop_commands = header.num_loop_commands;
+    num_pulse_commands = header.num_pulse_commands;
+    num_logic_commands = header.num_logic_commands;
+    uint8_t *starts[NUM_PROGRAM_SECTIONS];
+    uint16_t sizes[NUM_PROGRAM_SECTIONS];
+    if (get_program_sections(starts, sizes) > PROGRAM_SLOT_SIZE - sizeof(header)) {
+        clear_program();
+        return NOT_SAVED;
+    }
+    uint8_t *eeprom = program_slots[slot] + sizeof(header);
+    uint16_t crc = 0;
+    for (uint8_t i = 0; i < NUM_PROGRAM_SECTIONS; i++) {
+        eeprom_read_block(starts[i], eeprom, sizes[i]);
+        crc = crc_block(crc, starts[i], sizes[i]);
+        eeprom += sizes[i];
+    }
+    if (crc != header.image_crc) {
+        clear_program();
+        return NOT_SAVED;
+    }
+    link_program(); // the program may have been saved before "end"
+    program_crc = header.program_crc;
+    return NOERR;
+}
+
+err_t add_program_step(char *line, uint8_t *opcode_out) {
     // can assume line is null-terminated and is at least 2 chars in length
     if (parse_space_to_end(line)) {
         return NOERR;
@@ -334,113 +1602,540 @@ err_t add_program_step(char *line, command_t *function_out) {
         return BAD_FUNC;
     }
 
-    command_t function;
     char *params = line + 2; // at worst, points to null byte terminating the string
-    uint8_t *heap_end = program_heap + program_size*HEAP_PER_STEP;
-    if (program_size == MAX_PROGRAM_STEPS) {
-        return NO_ROOM;
+    // after the opcode, past any staged program; append_program_step() checks there is room
+    uint8_t *operands = program + program_size + staged_size + 1;
+    // a staged program's entries in the lo, hp and lb tables follow the stored program's
+    uint8_t loop_index = num_loop_commands + staged_loop_commands;
+    uint8_t pulse_index = num_pulse_commands + staged_pulse_commands;
+    uint8_t logic_index = num_logic_commands + staged_logic_commands;
+    struct step_syntax syntax;
+    if (!find_step_syntax(line, &syntax)) {
+        return BAD_FUNC;
     }
+    uint8_t opcode = syntax.opcode;
     bool success = true;
-    if (strncmp_P(line, PSTR("wh"), 2) == 0) {
-        function = &wait_high;
-        success = parse_pin(&params, heap_end);
-    } else if (strncmp_P(line, PSTR("wl"), 2) == 0) {
-        function = &wait_low;
-        success = parse_pin(&params, heap_end);
-    } else if (strncmp_P(line, PSTR("wc"), 2) == 0) {
-        function = &wait_change;
-        success = parse_pin(&params, heap_end);
-    } else if (strncmp_P(line, PSTR("wt"), 2) == 0) {
-        function = &set_wait_time;
-        success = parse_uint16(&params, 0x7FFF, heap_end);
-        (*(uint16_t *) heap_end) *= 2; // the delay is internally in half-microseconds
-    } else if (strncmp_P(line, PSTR("uh"), 2) == 0) {
-        function = &undebounced_wait_high;
-        success = parse_pin(&params, heap_end);
-    } else if (strncmp_P(line, PSTR("ul"), 2) == 0) {
-        function = &undebounced_wait_low;
-        success = parse_pin(&params, heap_end);
-    } else if (strncmp_P(line, PSTR("uc"), 2) == 0) {
-        function = &undebounced_wait_change;
-        success = parse_pin(&params, heap_end);
-    } else if (strncmp_P(line, PSTR("dm"), 2) == 0) {
-        function = &delay_milliseconds;
-        success = parse_uint16(&params, 0xFFFF, heap_end);
-    } else if (strncmp_P(line, PSTR("du"), 2) == 0) {
-        function = &delay_microseconds;
-        success = parse_uint16(&params, 0x7FFF, heap_end);
-        (*(uint16_t *) heap_end) *= 2; // the delay is internally in half-microseconds
-    } else if (strncmp_P(line, PSTR("tb"), 2) == 0) {
-        function = &timer_begin;
-    } else if (strncmp_P(line, PSTR("te"), 2) == 0) {
-        function = &timer_end;
-    } else if (strncmp_P(line, PSTR("pm"), 2) == 0) {
-        success = parse_pin(&params, heap_end);
-        if (success) {
-            struct pin *pin = pins + *(uint8_t *)(heap_end); // dig out parsed pin number
-            if (pin->ocr == NULL) {
-                return NOT_PWM;
-            }
-            heap_end++;
-            if (pin->pwm16) {
-                function = &pwm16;
-                success = parse_uint16(&params, PWM16_MAX, heap_end);
-            } else {
-                function = &pwm8;
-                success = parse_uint8(&params, 255, heap_end);
-            }
-        }
-    } else if (strncmp_P(line, PSTR("sh"), 2) == 0) {
-        function = &set_high;
-        success = parse_pin(&params, heap_end);
-    } else if (strncmp_P(line, PSTR("sl"), 2) == 0) {
-        function = &set_low;
-        success = parse_pin(&params, heap_end);
-    } else if (strncmp_P(line, PSTR("st"), 2) == 0) {
-        function = &set_tristate;
-        success = parse_pin(&params, heap_end);
-    } else if (strncmp_P(line, PSTR("rd"), 2) == 0) {
-        function = &read_digital;
-        success = parse_pin(&params, heap_end);
-    } else if (strncmp_P(line, PSTR("ra"), 2) == 0) {
-        function = &read_analog;
-        success = parse_pin(&params, heap_end);
-        if (success) {
-            struct pin *pin = pins + *(uint8_t *)(heap_end); // dig out parsed pin number
-            if (!pin->adc_mux_bits) {
-                return NOT_ANALOG;
-            }
-        }
-    } else if (strncmp_P(line, PSTR("ct"), 2) == 0) {
-        function = &char_transmit;
-        success = parse_uint8(&params, 255, heap_end);
-    } else if (strncmp_P(line, PSTR("cr"), 2) == 0) {
-        function = &char_receive;
-    } else if (strncmp_P(line, PSTR("cg"), 2) == 0) {
-        function = &char_goto;
-    } else if (strncmp_P(line, PSTR("lo"), 2) == 0) {
-        function = &loop;
-        if (num_loop_commands == MAX_LOOP_COMMANDS) {
-            return NO_ROOM;
-        }
-        success = parse_uint8(&params, (uint8_t) MAX_PROGRAM_STEPS-1, heap_end);
-        if (success) {
-            *(uint8_t *)++heap_end = num_loop_commands;
-            success = parse_uint16(&params, 0xFFFF, loop_initial_values+num_loop_commands);
-        }
-    } else if (strncmp_P(line, PSTR("go"), 2) == 0) {
-        function = &goto_;
-        success = parse_uint8(&params, (uint8_t) MAX_PROGRAM_STEPS-1, heap_end);
-    } else if (strncmp_P(line, PSTR("no"), 2) == 0) {
-        function = &noop;
-    } else {
-        return BAD_FUNC;
+    uint8_t pin;
+    switch (syntax.args) {
+        case ARGS_NONE:
+            break;
+        case ARGS_RESOLVED_PIN:
+            success = parse_resolved_pin(&params, operands);
+            break;
+        case ARGS_PIN_SET:
+            success = parse_pin_set(&params, operands);
+            break;
+        case ARGS_PIN_LEVEL: {
+            struct pin_wait *wait = (struct pin_wait *) operands;
+            uint8_t level;
+            success = parse_uint8(&params, 1, &level) && parse_pin_set(&params, &wait->pins);
+            for (uint8_t port = 0; port < NUM_PORTS; port++) {
+                wait->levels[port] = level ? wait->pins.masks[port] : 0;
+            }
+            break;
+        }
+        case ARGS_PIN_PATTERN: {
+            struct pin_wait *wait = (struct pin_wait *) operands;
+            uint32_t pattern;
+            success = parse_uint32(&params, 0xFFFFFFFF, &pattern) && parse_pin_set(&params, &wait->pins) &&
+                pin_set_values(&wait->pins, pattern, wait->levels);
+            break;
+        }
+        case ARGS_ANALOG_PIN:
+            success = parse_pin(&params, operands);
+            if (success) {
+                pin = *(uint8_t *)(operands); // dig out parsed pin number
+                if (!PIN_BYTE(pin, adc_mux_bits)) {
+                    return NOT_ANALOG;
+                }
+            }
+            break;
+        case ARGS_UINT8:
+            success = parse_uint8(&params, syntax.max, operands);
+            break;
+        case ARGS_OPTIONAL_UINT8:
+            *operands = 0;
+            if (!parse_space_to_end(params)) {
+                success = parse_uint8(&params, syntax.max, operands);
+            }
+            break;
+        case ARGS_UINT16:
+            success = parse_uint16(&params, syntax.max, operands);
+            break;
+        case ARGS_HALF_US:
+            success = parse_uint16(&params, syntax.max, operands);
+            (*(uint16_t *) operands) *= 2; // the delay is internally in half-microseconds
+            break;
+        case ARGS_DEADLINE:
+            // limited so that the deadline, in half-microseconds, is less than 2^31 ticks away
+            success = parse_uint32(&params, 0x3FFFFFFF, operands);
+            (*(uint32_t *) operands) *= 2;
+            break;
+        case ARGS_PWM:
+            success = parse_pin(&params, operands);
+            if (success) {
+                pin = *(uint8_t *)(operands); // dig out parsed pin number
+                if (PIN_PTR(pin, ocr) == NULL) {
+                    return NOT_PWM;
+                }
+                operands++;
+                if (PIN_BYTE(pin, pwm16)) {
+                    opcode = OP_PWM16;
+                    success = parse_uint16(&params, PWM16_MAX, operands);
+                } else {
+                    opcode = OP_PWM8;
+                    success = parse_uint8(&params, 255, operands);
+                }
+            }
+            break;
+        case ARGS_JUMP:
+            // the target is stored as its index, after the offset that link_program() fills in
+            success = parse_uint16(&params, PROGRAM_BYTES-1, operands + 2);
+            break;
+        case ARGS_LOOP:
+            if (loop_index == MAX_LOOP_COMMANDS) {
+                return NO_ROOM;
+            }
+            success = parse_uint16(&params, PROGRAM_BYTES-1, operands + 2);
+            if (success) {
+                operands[4] = loop_index;
+                success = parse_uint16(&params, 0xFFFF, loop_initial_values+loop_index);
+            }
+            break;
+        case ARGS_PULSE:
+            if (pulse_index == MAX_PULSE_COMMANDS) {
+                return NO_ROOM;
+            }
+            success = parse_pin(&params, operands);
+            if (success) {
+                pin = *(uint8_t *)(operands); // dig out parsed pin number
+                if (!PIN_BYTE(pin, pwm16)) { // only the Timer1 output-compare pins can generate pulse trains
+                    return NOT_PULSE;
+                }
+                *(uint8_t *)++operands = pulse_index;
+                struct pulse_train *train = pulse_trains + pulse_index;
+                success = parse_uint16(&params, 0xFFFF, &train->width_us) &&
+                    parse_uint16(&params, 0xFFFF, &train->period_us) &&
+                    parse_uint16(&params, 0xFFFF, &train->count) &&
+                    train->width_us > 0 && train->count > 0 &&
+                    (train->count == 1 || (uint32_t) train->width_us + MIN_PULSE_GAP_US <= train->period_us);
+            }
+            break;
+        case ARGS_SEQUENCE:
+            if ((execute_mode == STAGING ? staged_sequences : num_sequences) == MAX_SEQUENCES) {
+                return NO_ROOM;
+            }
+            break;
+        case ARGS_LOGIC: {
+            if (logic_index == MAX_LOGIC_COMMANDS) {
+                return NO_ROOM;
+            }
+            *(uint8_t *)operands = logic_index;
+            struct logic_config *config = logic_configs + logic_index;
+            config->num_pins = 0;
+            success = parse_uint8(&params, 255, &config->divider) && config->divider > 0;
+            while (success && !parse_space_to_end(params)) {
+                success = config->num_pins < MAX_LOGIC_PINS && parse_pin(&params, config->pins + config->num_pins);
+                config->num_pins++;
+            }
+            success = success && config->num_pins > 0;
+            break;
+        }
+        case ARGS_COUNTER:
+        case ARGS_COUNTER_EDGE:
+        case ARGS_COUNTER_GATE:
+            success = parse_pin(&params, operands);
+            if (!success) {
+                break;
+            }
+            if (counter_for_pin(*(uint8_t *) operands) == NO_COUNTER) {
+                return NOT_COUNTER;
+            }
+            operands++;
+            if (syntax.args == ARGS_COUNTER_EDGE) {
+                *operands = COUNT_RISING;
+                if (!parse_space_to_end(params)) {
+                    success = parse_uint8(&params, syntax.max, operands);
+                }
+            } else if (syntax.args == ARGS_COUNTER_GATE) {
+                success = parse_uint16(&params, syntax.max, operands) && *(uint16_t *) operands > 0;
+            }
+            break;
     }
 
     if (!success || !parse_space_to_end(params)) {
         return BAD_PARAM;
     }
-    // if everything worked, return the function
-    *function_out = function;
+    // if everything worked, return the opcode
+    *opcode_out = opcode;
     return NOERR;
-}
\ No newline at end of file
+}
+
+bool is_wait(uint8_t opcode) {
+    return opcode >= OP_UNDEBOUNCED_WAIT_HIGH && opcode <= OP_WAIT_CHANGE;
+}
+
+bool is_set_high_or_low(uint8_t opcode) {
+    return opcode == OP_SET_HIGH || opcode == OP_SET_LOW;
+}
+
+// number of program steps covered by a (possibly fused) step
+uint8_t step_span(uint8_t opcode) {
+    switch (opcode) {
+        case OP_PULSE_HIGH:
+        case OP_PULSE_LOW:
+            return 3;
+        case OP_SET_HIGH_THEN_WAIT:
+        case OP_SET_LOW_THEN_WAIT:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+// Peephole pass to replace common sequences of steps with single fused steps.
+// Only the opcode of the first step in a sequence is changed: the steps after
+// it keep their opcodes and operands (which the fused step uses), so a jump
+// into the middle of a fused sequence still runs the rest of it unfused.
+void fuse_program(void) {
+    uint8_t *step = program;
+    uint8_t *end = program + program_size;
+    while (step < end) {
+        uint8_t opcode = *step;
+        if (is_set_high_or_low(opcode)) {
+            uint8_t *second = next_step(step);
+            uint8_t *third = second < end ? next_step(second) : end;
+            if (third < end && *second == OP_DELAY_MICROSECONDS && is_set_high_or_low(*third)) {
+                *step = (opcode == OP_SET_HIGH) ? OP_PULSE_HIGH : OP_PULSE_LOW;
+            } else if (second < end && is_wait(*second)) {
+                *step = (opcode == OP_SET_HIGH) ? OP_SET_HIGH_THEN_WAIT : OP_SET_LOW_THEN_WAIT;
+            }
+        }
+        // never start a fused sequence inside another: the fused step depends on the opcodes that follow it
+        step = skip_steps(step, step_span(*step));
+    }
+}
+
+// Fill in the byte offset of the target of each go and lo step from its step
+// index. The index is kept, so this can be redone after steps are added.
+// Also find where each sequence starts: after each sq step.
+void link_program(void) {
+    uint8_t *step = program;
+    uint8_t *end = program + program_size;
+    num_sequences = 1;
+    sequence_starts[0] = 0;
+    while (step < end) {
+        if (*step == OP_GOTO || *step == OP_LOOP) {
+            uint16_t *target = (uint16_t *) (step + 1);
+            target[0] = step_offset(target[1]);
+        } else if (*step == OP_SEQUENCE) {
+            sequence_starts[num_sequences++] = next_step(step) - program;
+        }
+        step = next_step(step);
+    }
+}
+
+// Replace the stored program with the staged one, moving it and its table
+// entries to the start of program[] and of the tables.
+void swap_program(void) {
+    memmove(program, program + program_size, staged_size);
+    memmove(loop_initial_values, loop_initial_values + num_loop_commands, staged_loop_commands * sizeof(uint16_t));
+    memmove(pulse_trains, pulse_trains + num_pulse_commands, staged_pulse_commands * sizeof(struct pulse_train));
+    memmove(logic_configs, logic_configs + num_logic_commands, staged_logic_commands * sizeof(struct logic_config));
+    for (uint8_t *step = program; step < program + staged_size; step = next_step(step)) {
+        uint8_t *params = step + 1;
+        if (*step == OP_LOOP) {
+            params[4] -= num_loop_commands;
+        } else if (*step == OP_HARDWARE_PULSE) {
+            params[1] -= num_pulse_commands;
+        } else if (*step == OP_LOGIC_BEGIN) {
+            params[0] -= num_logic_commands;
+        }
+    }
+    program_size = staged_size;
+    program_crc = staged_crc;
+    num_loop_commands = staged_loop_commands;
+    num_pulse_commands = staged_pulse_commands;
+    num_logic_commands = staged_logic_commands;
+    for (uint8_t i = 0; i < num_loop_commands; i++) {
+        loop_active[i] = false;
+    }
+    discard_staged_program();
+    fuse_program();
+    link_program();
+    // the trace refers to steps by their place in the program, so restart it
+    if (trace_active) {
+        trace_start();
+    } else {
+        trace_discard();
+    }
+}
+
+// two-character names of each opcode_t, for listing the program; fused steps are listed by their first step's name
+const char OPCODE_NAMES[][3] PROGMEM = {"uh", "ul", "uc", "wh", "wl", "wc", "wt", "dm", "du", "tb", "te", "pm", "pm",
+    "sh", "sl", "st", "rd", "ra", "cr", "ct", "cg", "lo", "go", "no", "hp", "hw", "ib", "ie", "lb", "le", "mk", "wu", "wn",
+    "tl", "tr", "sq", "mh", "ml", "mr", "wa", "wp", "wo", "wx",
+    "kb", "ke", "kr", "kz", "kf", "sh", "sl", "sh", "sl"};
+
+void write_uint(uint16_t value) {
+    char result[6];
+    utoa(value, result, 10);
+    usb_serial_write_byte(' ');
+    usb_serial_write_string(result);
+}
+
+void write_ulong(uint32_t value) {
+    char result[11];
+    ultoa(value, result, 10);
+    usb_serial_write_byte(' ');
+    usb_serial_write_string(result);
+}
+
+// '?' for a pin number past the end of pins[], as unresolve_pin() returns
+// when no pin matches
+void write_pin_name(uint8_t pin_number) {
+    usb_serial_write_byte(' ');
+    if (pin_number >= NUM_PINS) {
+        usb_serial_write_byte('?');
+        return;
+    }
+    usb_serial_write_string_P(pins[pin_number].name);
+}
+
+// the pins of a set, in the order of pins[]
+void write_pin_set(struct pin_set *set) {
+    for (uint8_t i = 0; i < NUM_PINS; i++) {
+        if (in_pin_set(set, i)) {
+            write_pin_name(i);
+        }
+    }
+}
+
+// write a single program step in the same form as it was entered
+void write_step(uint8_t *step) {
+    uint8_t opcode = *step;
+    uint8_t *params = step + 1;
+    usb_serial_write_string_P(OPCODE_NAMES[opcode]);
+    switch (opcode) {
+        case OP_SET_WAIT_TIME:
+        case OP_DELAY_MICROSECONDS:
+            write_uint(*(uint16_t *) params / 2); // stored in half-microseconds
+            break;
+        case OP_DELAY_MILLISECONDS:
+            write_uint(*(uint16_t *) params);
+            break;
+        case OP_PWM8:
+            write_pin_name(params[0]);
+            write_uint(params[1]);
+            break;
+        case OP_PWM16:
+            write_pin_name(params[0]);
+            write_uint(*(uint16_t *) (params + 1));
+            break;
+        case OP_READ_ANALOG:
+            write_pin_name(params[0]);
+            break;
+        case OP_CHAR_TRANSMIT:
+        case OP_INPUT_CAPTURE_BEGIN:
+            write_uint(params[0]);
+            break;
+        case OP_GOTO:
+            write_uint(*(uint16_t *) (params + 2));
+            break;
+        case OP_WAIT_UNTIL:
+        case OP_WAIT_NEXT:
+            write_ulong(*(uint32_t *) params / 2); // stored in half-microseconds
+            break;
+        case OP_LOOP:
+            write_uint(*(uint16_t *) (params + 2));
+            write_uint(loop_initial_values[params[4]]);
+            break;
+        case OP_HARDWARE_PULSE:
+            write_pin_name(params[0]);
+            write_uint(pulse_trains[params[1]].width_us);
+            write_uint(pulse_trains[params[1]].period_us);
+            write_uint(pulse_trains[params[1]].count);
+            break;
+        case OP_WAIT_ALL:
+        case OP_WAIT_ANY:
+        case OP_WAIT_PATTERN: {
+            struct pin_wait *wait = (struct pin_wait *) params;
+            uint32_t levels = pin_set_bits(&wait->pins, wait->levels);
+            if (opcode == OP_WAIT_PATTERN) {
+                write_ulong(levels);
+            } else {
+                write_uint(levels != 0); // all the pins have the same level
+            }
+            write_pin_set(&wait->pins);
+            break;
+        }
+        case OP_MULTI_SET_HIGH:
+        case OP_MULTI_SET_LOW:
+        case OP_MULTI_READ:
+        case OP_WAIT_ANY_CHANGE:
+            write_pin_set((struct pin_set *) params);
+            break;
+        case OP_LOGIC_BEGIN: {
+            struct logic_config *config = logic_configs + params[0];
+            write_uint(config->divider);
+            for (uint8_t i = 0; i < config->num_pins; i++) {
+                write_pin_name(config->pins[i]);
+            }
+            break;
+        }
+        case OP_COUNT_BEGIN:
+            write_pin_name(params[0]);
+            if (params[1] != COUNT_RISING) { // list the default edge as it was most likely entered
+                write_uint(params[1]);
+            }
+            break;
+        case OP_COUNT_END:
+        case OP_COUNT_READ:
+        case OP_COUNT_ZERO:
+            write_pin_name(params[0]);
+            break;
+        case OP_COUNT_FREQUENCY:
+            write_pin_name(params[0]);
+            write_uint(*(uint16_t *) (params + 1));
+            break;
+        case OP_TIMER_BEGIN:
+        case OP_TIMER_END:
+        case OP_TIMER_LAP:
+            if (params[0] != 0) { // list unnumbered timers as they were most likely entered
+                write_uint(params[0]);
+            }
+            break;
+        case OP_TIMER_READ:
+        case OP_SEQUENCE:
+        case OP_CHAR_RECEIVE:
+        case OP_CHAR_GOTO:
+        case OP_NOOP:
+        case OP_HARDWARE_PULSE_WAIT:
+        case OP_INPUT_CAPTURE_END:
+        case OP_LOGIC_END:
+        case OP_MARK:
+            break;
+        default: // all the rest take a resolved pin
+            write_pin_name(unresolve_pin((struct resolved_pin *) params));
+            break;
+    }
+}
+
+// The pin used by a step, for the trace; NO_TRACE_PIN if it has none.
+#define NO_TRACE_PIN 0xFF
+uint8_t step_pin(uint8_t *step) {
+    uint8_t *params = step + 1;
+    switch (*step) {
+        case OP_PWM8:
+        case OP_PWM16:
+        case OP_READ_ANALOG:
+        case OP_HARDWARE_PULSE:
+        case OP_COUNT_BEGIN:
+        case OP_COUNT_END:
+        case OP_COUNT_READ:
+        case OP_COUNT_ZERO:
+        case OP_COUNT_FREQUENCY:
+            return params[0];
+        case OP_UNDEBOUNCED_WAIT_HIGH:
+        case OP_UNDEBOUNCED_WAIT_LOW:
+        case OP_UNDEBOUNCED_WAIT_CHANGE:
+        case OP_WAIT_HIGH:
+        case OP_WAIT_LOW:
+        case OP_WAIT_CHANGE:
+        case OP_SET_HIGH:
+        case OP_SET_LOW:
+        case OP_SET_TRISTATE:
+        case OP_READ_DIGITAL:
+        case OP_PULSE_HIGH:
+        case OP_PULSE_LOW:
+        case OP_SET_HIGH_THEN_WAIT:
+        case OP_SET_LOW_THEN_WAIT: {
+            uint8_t pin = unresolve_pin((struct resolved_pin *) params);
+            return (pin < NUM_PINS) ? pin : NO_TRACE_PIN;
+        }
+        default:
+            return NO_TRACE_PIN;
+    }
+}
+
+// Write the trace of the last run, one step per line: the step index, its
+// name, its pin (or '-') and the µs from the start of the run to when the
+// step completed. In binary output mode each step is a RESULT_TRACE record.
+// Step indices are found by walking the program from the last recorded step,
+// or from the start when a jump went backwards.
+void write_trace(void) {
+    uint8_t *in = capture_buffer;
+    uint8_t *step = program;
+    uint16_t index = 0;
+    uint32_t time = 0; // in half-microseconds
+    while (in < trace_end) {
+        uint8_t *target = program + read_varint(&in);
+        time += read_varint(&in);
+        if (target < step) {
+            step = program;
+            index = 0;
+        }
+        for (; step < target; index++) {
+            step = next_step(step);
+        }
+        uint8_t pin = step_pin(step);
+        uint32_t us = (time + 1) / 2;
+        if (binary_output) {
+            uint8_t tag = RESULT_TRACE;
+            char names[4] = {0, 0, 0, 0}; // step name, then pin name, NUL-padded
+            memcpy_P(names, OPCODE_NAMES[*step], 2);
+            if (pin != NO_TRACE_PIN) {
+                strncpy_P(names + 2, pins[pin].name, 2);
+            }
+            usb_serial_write_data(&tag, 1);
+            usb_serial_write_data(&index, 2);
+            usb_serial_write_data(names, 4);
+            usb_serial_write_data(&us, 4);
+        } else {
+            char result[6];
+            utoa(index, result, 10);
+            usb_serial_write_string(result);
+            usb_serial_write_byte(' ');
+            usb_serial_write_string_P(OPCODE_NAMES[*step]);
+            if (pin != NO_TRACE_PIN) {
+                write_pin_name(pin);
+            } else {
+                usb_serial_write_string_P(PSTR(" -"));
+            }
+            write_ulong(us);
+            usb_serial_write_byte('\n');
+        }
+    }
+    if (trace_dropped) {
+        if (!binary_output) {
+            usb_serial_write_string_P(PSTR("dropped "));
+        }
+        write_result(RESULT_DROPPED, trace_dropped, 2);
+    }
+    usb_serial_end_result();
+}
+
+// List the stored program one step per line, preceded by the step index.
+// Fused steps are shown as their component steps joined by '+'; the
+// component steps after the first are also listed on their own lines, as they
+// can still be jumped to individually.
+void list_program(void) {
+    uint8_t *step = program;
+    uint8_t *end = program + program_size;
+    for (uint16_t i = 0; step < end; i++) {
+        uint8_t span = step_span(*step);
+        usb_serial_write_byte(span > 1 ? '*' : ' ');
+        write_uint(i);
+        usb_serial_write_byte(':');
+        usb_serial_write_byte(' ');
+        write_step(step);
+        uint8_t *component = step;
+        for (uint8_t j = 1; j < span; j++) {
+            component = next_step(component);
+            usb_serial_write_string_P(PSTR(" + "));
+            write_step(component);
+        }
+        usb_serial_write_byte('\n');
+        step = next_step(step);
+    }
+}
@@ -8,26 +8,43 @@
 #ifndef interpreter_h
 #define interpreter_h
 
+#include <util/atomic.h>
 #include "utils.h"
 
 void interpreter_init(void);
 void interpreter_main(void);
+void stop_pulse_train(void);
 
 #define QUIT_BYTE 33 // '!' character
-#define MS_TIMER_MASK BIT(OCIE3A)
 #define USB_TIMER_MASK BIT(OCIE3C)
+#define TIMEBASE_MASK BIT(TOIE3)
 #define TIMER3_ENABLE BIT(CS31)
-#define TIMER3_DISABLE 0
-
-extern uint8_t program_counter;
-extern uint16_t loop_initial_values[];
-extern uint16_t loop_current_values[];
-extern bool loop_active[];
+#define PWM16_MAX (uint16_t) (1<<10)-1
+#define TIMER1_PWM_MODE (BIT(WGM13) | BIT(WGM12)) // TCCR1B bits for mode 14: fast PWM with TOP defined by ICR1
+
+// Timer3 runs continuously, as the timebase, so a compare register is set
+// relative to TCNT3 with interrupts off: at most one tick then passes between
+// reading the count and setting the target, which must be at least 2 ticks away.
+#define SET_TIMER3_COMPARE(_OCR, _TICKS) ATOMIC_BLOCK(ATOMIC_RESTORESTATE) { (_OCR) = TCNT3 + (_TICKS); }
+
+struct pulse_train {
+    uint16_t width_us;
+    uint16_t period_us;
+    uint16_t count;
+};
+
+extern struct pulse_train pulse_trains[];
+extern volatile uint16_t pulses_remaining;
+extern volatile uint8_t pulse_train_pin;
+extern volatile bool pulse_train_active;
 extern volatile bool run_serial_tasks_from_isr;
 extern volatile bool running;
-extern volatile uint16_t ms_timer;
-extern volatile uint16_t ms_timer_target;
-extern volatile bool ms_timer_done;
+extern bool binary_output;
+extern uint32_t timebase_mark;
+
+// Half-microseconds since startup, from Timer3 and a count of its overflows;
+// wraps around every 35.8 minutes.
+uint32_t timebase_now(void);
 
 
 #endif /* interpreter_h */
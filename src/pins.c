@@ -5,6 +5,7 @@
 // it under the terms of version 2 of the GNU General Public License as
 // published by the Free Software Foundation.
 
+#include <string.h>
 #include "pins.h"
 
 #ifdef ARDUINO_PIN_NAMES
@@ -19,7 +20,7 @@
 #define INIT_PWM8_PIN(_ARD_NAME, _PORT, _PIN, _TIMER, _CHANNEL, _ADC) INIT_PWM_PIN(_ARD_NAME, _PORT, _PIN, _TIMER, _CHANNEL, false, TCCR##_TIMER##A, _ADC)
 #define INIT_PWM16_PIN(_ARD_NAME, _PORT, _PIN, _TIMER, _CHANNEL, _ADC) INIT_PWM_PIN(_ARD_NAME, _PORT, _PIN, _TIMER, _CHANNEL, true, TCCR##_TIMER##A, _ADC)
 
-struct pin pins[] = {
+const struct pin pins[] PROGMEM = {
     INIT_PIN(SS, B, 0, 0),
     INIT_PIN(SC, B, 1, 0),
     INIT_PIN(MO, B, 2, 0),
@@ -47,4 +48,128 @@ struct pin pins[] = {
     INIT_PIN(A0, F, 7, 128+7)  // ADC7
 };
 
-uint8_t NUM_PINS = ARRAYLEN(pins);
\ No newline at end of file
+uint8_t NUM_PINS = ARRAYLEN(pins);
+
+// Indices into pins[], sorted by name, so that names can be looked up by binary
+// search. The order depends on the pin-naming scheme, so it is worked out at
+// startup rather than written out by hand.
+uint8_t pins_by_name[ARRAYLEN(pins)];
+
+// A one- or two-character name as a number that sorts like the name does.
+static inline uint16_t name_key(const char *name) {
+    return ((uint16_t) (uint8_t) name[0] << 8) | (uint8_t) name[1];
+}
+
+static inline uint16_t pin_name_key(uint8_t pin_number) {
+    return ((uint16_t) PIN_BYTE(pin_number, name[0]) << 8) | PIN_BYTE(pin_number, name[1]);
+}
+
+void pins_init(void) {
+    // insertion sort: there are only a couple dozen pins
+    for (uint8_t i = 0; i < NUM_PINS; i++) {
+        uint8_t j = i;
+        while (j > 0 && pin_name_key(pins_by_name[j-1]) > pin_name_key(i)) {
+            pins_by_name[j] = pins_by_name[j-1];
+            j--;
+        }
+        pins_by_name[j] = i;
+    }
+}
+
+uint8_t find_pin(const char *name, uint8_t length) {
+    uint16_t key = name_key(name);
+    if (length == 1) {
+        key &= 0xFF00;
+    }
+    uint8_t low = 0;
+    uint8_t high = NUM_PINS;
+    while (low < high) {
+        uint8_t middle = (low + high) / 2;
+        uint16_t middle_key = pin_name_key(pins_by_name[middle]);
+        if (key == middle_key) {
+            return pins_by_name[middle];
+        } else if (key < middle_key) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+    return NO_PIN;
+}
+
+void resolve_pin(uint8_t pin_number, struct resolved_pin *dst) {
+    dst->pin_reg = (uint8_t)(uintptr_t) PIN_PTR(pin_number, pin);
+    dst->mask = PIN_BYTE(pin_number, pin_mask);
+    dst->pwm_pin = (PIN_PTR(pin_number, ocr) != NULL) ? pin_number : NO_PWM;
+}
+
+uint8_t unresolve_pin(const struct resolved_pin *resolved) {
+    uint8_t i;
+    for (i = 0; i < NUM_PINS; i++) {
+        if ((uint8_t)(uintptr_t) PIN_PTR(i, pin) == resolved->pin_reg && PIN_BYTE(i, pin_mask) == resolved->mask) {
+            break;
+        }
+    }
+    return i;
+}
+
+static inline uint8_t port_index(uint8_t pin_number) {
+    return PORT_INDEX((uint8_t)(uintptr_t) PIN_PTR(pin_number, pin));
+}
+
+void add_to_pin_set(struct pin_set *set, uint8_t pin_number) {
+    set->masks[port_index(pin_number)] |= PIN_BYTE(pin_number, pin_mask);
+    if (PIN_PTR(pin_number, ocr) != NULL) {
+        set->pwm = true;
+    }
+}
+
+bool in_pin_set(const struct pin_set *set, uint8_t pin_number) {
+    return set->masks[port_index(pin_number)] & PIN_BYTE(pin_number, pin_mask);
+}
+
+void set_pin_set_inputs(const struct pin_set *set) {
+    for (uint8_t port = 0; port < NUM_PORTS; port++) {
+        volatile uint8_t *pin_reg = &PINB + 3*port;
+        pin_reg[1] &= ~set->masks[port]; // set pins for input
+        pin_reg[2] |= set->masks[port]; // enable pullup resistors
+    }
+}
+
+// The ports are read one after the other, as close together as possible.
+void read_pin_set(const struct pin_set *set, uint8_t *values) {
+    values[0] = PINB & set->masks[0];
+    values[1] = PINC & set->masks[1];
+    values[2] = PIND & set->masks[2];
+    values[3] = PINE & set->masks[3];
+    values[4] = PINF & set->masks[4];
+}
+
+uint32_t pin_set_bits(const struct pin_set *set, const uint8_t *values) {
+    uint32_t bits = 0;
+    uint32_t bit = 1;
+    for (uint8_t i = 0; i < NUM_PINS; i++) {
+        uint8_t port = port_index(i);
+        if (set->masks[port] & PIN_BYTE(i, pin_mask)) {
+            if (values[port] & PIN_BYTE(i, pin_mask)) {
+                bits |= bit;
+            }
+            bit <<= 1;
+        }
+    }
+    return bits;
+}
+
+bool pin_set_values(const struct pin_set *set, uint32_t bits, uint8_t *values) {
+    memset(values, 0, NUM_PORTS);
+    for (uint8_t i = 0; i < NUM_PINS; i++) {
+        uint8_t port = port_index(i);
+        if (set->masks[port] & PIN_BYTE(i, pin_mask)) {
+            if (bits & 1) {
+                values[port] |= PIN_BYTE(i, pin_mask);
+            }
+            bits >>= 1;
+        }
+    }
+    return bits == 0;
+}
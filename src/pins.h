@@ -8,6 +8,7 @@
 #ifndef pins_h
 #define pins_h
 
+#include <avr/pgmspace.h>
 #include "utils.h"
 
 struct pin {
@@ -24,18 +25,69 @@ struct pin {
 	                            // top bit is 1 if ADC is available on this pin at all.
 };
 
-extern struct pin pins[];
+extern const struct pin pins[] PROGMEM;
 extern uint8_t NUM_PINS;
 
-#define SET_PIN_LOW(_PIN_IDX, _REGISTER) SET_MASK_LO(*(pins[_PIN_IDX]._REGISTER), pins[_PIN_IDX].pin_mask)
-#define SET_PIN_HIGH(_PIN_IDX, _REGISTER) SET_MASK_HI(*(pins[_PIN_IDX]._REGISTER), pins[_PIN_IDX].pin_mask)
-#define GET_PIN(_PIN_IDX, _REGISTER) GET_MASK(*(pins[_PIN_IDX]._REGISTER), pins[_PIN_IDX].pin_mask)
-#define ENABLE_PWM(_PIN_IDX) SET_MASK_HI(*(pins[_PIN_IDX].tccr), pins[_PIN_IDX].tccr_mask)
-#define DISABLE_PWM(_PIN_IDX) SET_MASK_LO(*(pins[_PIN_IDX].tccr), pins[_PIN_IDX].tccr_mask)
+// pins[] lives in flash to save RAM, so its fields must be read with these.
+#define PIN_PTR(_PIN_IDX, _FIELD) ((volatile void *) pgm_read_ptr(&pins[_PIN_IDX]._FIELD))
+#define PIN_REG(_PIN_IDX, _FIELD) ((volatile uint8_t *) PIN_PTR(_PIN_IDX, _FIELD))
+#define PIN_BYTE(_PIN_IDX, _FIELD) pgm_read_byte(&pins[_PIN_IDX]._FIELD)
+
+#define SET_PIN_LOW(_PIN_IDX, _REGISTER) SET_MASK_LO(*PIN_REG(_PIN_IDX, _REGISTER), PIN_BYTE(_PIN_IDX, pin_mask))
+#define SET_PIN_HIGH(_PIN_IDX, _REGISTER) SET_MASK_HI(*PIN_REG(_PIN_IDX, _REGISTER), PIN_BYTE(_PIN_IDX, pin_mask))
+#define GET_PIN(_PIN_IDX, _REGISTER) GET_MASK(*PIN_REG(_PIN_IDX, _REGISTER), PIN_BYTE(_PIN_IDX, pin_mask))
+#define ENABLE_PWM(_PIN_IDX) SET_MASK_HI(*PIN_REG(_PIN_IDX, tccr), PIN_BYTE(_PIN_IDX, tccr_mask))
+#define DISABLE_PWM(_PIN_IDX) SET_MASK_LO(*PIN_REG(_PIN_IDX, tccr), PIN_BYTE(_PIN_IDX, tccr_mask))
+
+// A pin resolved at program-entry time into the registers needed to drive it,
+// so that program steps don't have to look anything up in pins[] at run time.
+// The AVR places each port's PINx, DDRx and PORTx registers at consecutive
+// addresses (all below 0x100), so only the PINx address need be stored.
+struct resolved_pin {
+    uint8_t pin_reg; // data-space address of the PINx register
+    uint8_t mask; // mask of the relevant bit for that pin
+    uint8_t pwm_pin; // index into pins[] if PWM must be disconnected, NO_PWM otherwise
+};
+#define NO_PWM 0xFF
+
+#define NO_PIN 0xFF
+
+// A set of pins, as the mask of its pins in each port, so that steps on several
+// pins can update or read each port at once. The PINx registers of ports B to
+// F are 3 bytes apart, so the index of a port follows from its PINx address.
+#define NUM_PORTS 5 // B, C, D, E, F
+#define PORT_INDEX(_PIN_REG) (((_PIN_REG) - (uint8_t)(uintptr_t) &PINB) / 3)
+struct pin_set {
+    uint8_t masks[NUM_PORTS];
+    bool pwm; // true if any of the pins has PWM, which must be disconnected to set it
+};
+
+void pins_init(void);
+// Look up a pin by a name of length 1 or 2 (which need not be null-terminated);
+// returns the index into pins[], or NO_PIN if there is no such pin.
+uint8_t find_pin(const char *name, uint8_t length);
+
+void resolve_pin(uint8_t pin_number, struct resolved_pin *dst);
+uint8_t unresolve_pin(const struct resolved_pin *resolved); // returns the index into pins[]
+
+void add_to_pin_set(struct pin_set *set, uint8_t pin_number);
+bool in_pin_set(const struct pin_set *set, uint8_t pin_number);
+void set_pin_set_inputs(const struct pin_set *set); // with pull-ups
+void read_pin_set(const struct pin_set *set, uint8_t *values); // masked value of each port
+uint32_t pin_set_bits(const struct pin_set *set, const uint8_t *values); // bit i is the i'th pin of the set, in the order of pins[]
+bool pin_set_values(const struct pin_set *set, uint32_t bits, uint8_t *values); // the reverse; false if there are too many bits
+
+#define RESOLVED_REG(_RESOLVED, _OFFSET) (*(volatile uint8_t *)(uintptr_t)((_RESOLVED)->pin_reg + (_OFFSET)))
+#define RESOLVED_PIN(_RESOLVED) RESOLVED_REG(_RESOLVED, 0)
+#define RESOLVED_DDR(_RESOLVED) RESOLVED_REG(_RESOLVED, 1)
+#define RESOLVED_PORT(_RESOLVED) RESOLVED_REG(_RESOLVED, 2)
+#define SET_RESOLVED_LOW(_RESOLVED, _REGISTER) SET_MASK_LO(RESOLVED_##_REGISTER(_RESOLVED), (_RESOLVED)->mask)
+#define SET_RESOLVED_HIGH(_RESOLVED, _REGISTER) SET_MASK_HI(RESOLVED_##_REGISTER(_RESOLVED), (_RESOLVED)->mask)
+#define GET_RESOLVED(_RESOLVED) GET_MASK(RESOLVED_PIN(_RESOLVED), (_RESOLVED)->mask)
 
 #define ADMUX_MUX_MASK (BIT(MUX4) | BIT(MUX3) | BIT(MUX2) | BIT(MUX1) | BIT(MUX0))
 #define ADCSRB_MUX_MASK (BIT(MUX5))
-#define ADC_MUX(_PIN_IDX) { SET_MASKED_BITS(ADMUX, ADMUX_MUX_MASK, pins[_PIN_IDX].adc_mux_bits);\
-                            SET_MASKED_BITS(ADCSRB, ADCSRB_MUX_MASK, pins[_PIN_IDX].adc_mux_bits); } 
+#define ADC_MUX(_PIN_IDX) { SET_MASKED_BITS(ADMUX, ADMUX_MUX_MASK, PIN_BYTE(_PIN_IDX, adc_mux_bits));\
+                            SET_MASKED_BITS(ADCSRB, ADCSRB_MUX_MASK, PIN_BYTE(_PIN_IDX, adc_mux_bits)); } 
 
 #endif /* pins_h */
@@ -8,6 +8,33 @@
 #include "usb_serial.h"
 #include <avr/pgmspace.h>
 
+#ifdef SIMULATOR
+// A build to run under the simavr simulator, for benchmarking without a
+// device (see "make bench-sim"). USB is left alone: the input is a script
+// compiled in as sim_input (generated by the benchmark script), and the
+// output goes to simavr's console register, which it prints a line at a time.
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/avr_mcu_section.h>
+#include "sim_input.h"
+AVR_MCU(F_CPU, "atmega32u4");
+AVR_MCU_SIMAVR_CONSOLE(&GPIOR0);
+const char *sim_cursor = sim_input;
+
+// The next byte of the script. Once it has all been read, stop the simulator,
+// which ends the simulation when the CPU sleeps with interrupts off.
+uint8_t sim_next_byte(void) {
+    uint8_t byte = pgm_read_byte(sim_cursor);
+    if (byte == '\0') {
+        cli();
+        sleep_enable();
+        sleep_cpu();
+    }
+    sim_cursor++;
+    return byte;
+}
+#endif
+
 // Delete character.
 #define DEL 0x7F
 
@@ -17,14 +44,56 @@ char input_buffer[USB_IBUF];
 volatile char *buffer_cursor = input_buffer;
 char *buffer_end = input_buffer + USB_IBUF;
 
+// Output is held in a ring buffer and handed to LUFA in blocks, so that the IN
+// endpoint is filled a whole packet at a time rather than a byte at a time.
+#define OBUF_MASK (USB_OBUF - 1)
+uint8_t output_buffer[USB_OBUF];
+uint8_t output_head = 0; // next byte written goes here
+uint8_t output_tail = 0; // next byte sent comes from here
+volatile bool usb_serial_output_busy = false; // set while the main loop is using the output buffer
+uint8_t usb_serial_flush_threshold = 0;
+
 
 /*
  * Public API.
  */
 
 void usb_serial_init() {
+#ifdef SIMULATOR
+    state = UP;
+    usb_serial_echo = false;
+#else
     // Initialise LUFA.
     USB_Init();
+#endif
+}
+
+// Hand all buffered output to LUFA. Must only be called with
+// usb_serial_output_busy set, or from an ISR when it is not set.
+void usb_serial_send_buffered(void) {
+#ifdef SIMULATOR
+    for (; output_tail != output_head; output_tail = (output_tail + 1) & OBUF_MASK) {
+        GPIOR0 = output_buffer[output_tail];
+    }
+#else
+    if (output_tail > output_head) {
+        // send the part that wraps around the end of the buffer first
+        CDC_Device_SendData(&serialDevice, output_buffer + output_tail, USB_OBUF - output_tail);
+        output_tail = 0;
+    }
+    if (output_tail < output_head) {
+        CDC_Device_SendData(&serialDevice, output_buffer + output_tail, output_head - output_tail);
+        output_tail = output_head;
+    }
+#endif
+}
+
+void buffer_byte(uint8_t byte) {
+    if (((output_head + 1) & OBUF_MASK) == output_tail) {
+        usb_serial_send_buffered(); // full
+    }
+    output_buffer[output_head] = byte;
+    output_head = (output_head + 1) & OBUF_MASK;
 }
 
 int16_t usb_serial_write_byte(uint8_t byte) {
@@ -33,22 +102,27 @@ int16_t usb_serial_write_byte(uint8_t byte) {
         return EOF;
     }
 
-    char c = (char) byte;
+    usb_serial_output_busy = true;
     // CRLF handling.
-    if (c == '\n') {
-        if (CDC_Device_SendByte(&serialDevice, '\r') != ENDPOINT_READYWAIT_NoError) {
-            return EOF;
-        }
+    if (byte == '\n') {
+        buffer_byte('\r');
     }
+    buffer_byte(byte);
+    usb_serial_output_busy = false;
+    return byte;
+}
 
-    // Output the character.
-    if (CDC_Device_SendByte(&serialDevice, c) != ENDPOINT_READYWAIT_NoError) {
-        return EOF;
+void usb_serial_write_data(const void *data, uint8_t size) {
+    if (state != UP) {
+        return;
     }
-    return c;
+    usb_serial_output_busy = true;
+    for (const uint8_t *byte = data; size > 0; size--) {
+        buffer_byte(*byte++);
+    }
+    usb_serial_output_busy = false;
 }
 
-
 void usb_serial_process_byte(uint8_t byte) {
     char c = (char) byte;
     switch (c) {
@@ -91,10 +165,25 @@ void usb_serial_process_byte(uint8_t byte) {
 }
 
 void usb_serial_flush(void) {
+    usb_serial_output_busy = true;
+    usb_serial_send_buffered();
     CDC_Device_USBTask(&serialDevice);
+    usb_serial_output_busy = false;
+}
+
+void usb_serial_end_result(void) {
+    if (((output_head - output_tail) & OBUF_MASK) >= usb_serial_flush_threshold) {
+        usb_serial_flush();
+    }
 }
 
 char *usb_serial_read_line(void) {
+    usb_serial_flush();
+#ifdef SIMULATOR
+    while (!has_line) {
+        usb_serial_process_byte(sim_next_byte());
+    }
+#endif
     while(!has_line) {
         while(state != UP) {
             CDC_Device_USBTask(&serialDevice);
@@ -115,13 +204,28 @@ char *usb_serial_read_line(void) {
     return input_buffer;
 }
 
+// If a whole line has been received, return it null-terminated as
+// usb_serial_read_line() does, but leave it in the buffer until
+// usb_serial_discard_line(); otherwise return NULL. Doesn't wait.
+char *usb_serial_peek_line(void) {
+    if (!has_line) {
+        return NULL;
+    }
+    *(buffer_cursor - 1) = '\0';
+    return input_buffer;
+}
+
+void usb_serial_discard_line(void) {
+    buffer_cursor = input_buffer;
+    has_line = false;
+}
+
 void usb_serial_write_string(const char *data) {
     while (*data != '\0') {
         if (usb_serial_write_byte(*data++) == EOF) {
             return;
         }
     }
-    CDC_Device_USBTask(&serialDevice);
 }
 
 void usb_serial_write_string_P(const char *data) {
@@ -130,10 +234,13 @@ void usb_serial_write_string_P(const char *data) {
             return;
         }
     }
-    CDC_Device_USBTask(&serialDevice);
 }
 
 uint8_t usb_serial_wait_byte(void) {
+    usb_serial_flush();
+#ifdef SIMULATOR
+    return sim_next_byte();
+#endif
     while(state != UP) {
         CDC_Device_USBTask(&serialDevice);
     }
@@ -145,6 +252,9 @@ uint8_t usb_serial_wait_byte(void) {
 }
 
 bool usb_serial_has_byte(uint8_t *byte_out) {
+#ifdef SIMULATOR
+    return false; // like a host that waits for each run to end before sending more
+#endif
     if (state != UP) {
         return false;
     }
@@ -17,16 +17,31 @@
 #define USB_IBUF 80
 #endif
 
+//  output buffer size: must be a power of two no larger than 256
+#ifndef USB_OBUF
+#define USB_OBUF 128
+#endif
+
 extern bool usb_serial_echo;
+extern volatile bool usb_serial_output_busy;
+// Output waiting to be sent is flushed after a result is written (see
+// usb_serial_end_result) only if at least this many bytes are waiting.
+// Zero flushes after every result.
+extern uint8_t usb_serial_flush_threshold;
 
 void usb_serial_init(void);
 int16_t usb_serial_write_byte(uint8_t byte);
+void usb_serial_write_data(const void *data, uint8_t size); // raw bytes, with no CRLF handling
 void usb_serial_flush(void);
+void usb_serial_end_result(void);
+void usb_serial_send_buffered(void);
 void usb_serial_write_string(const char *data);
 void usb_serial_write_string_P(const char *data);
 uint8_t usb_serial_wait_byte(void);
 bool usb_serial_has_byte(uint8_t *byte_out);
 void usb_serial_process_byte(uint8_t byte);
 char *usb_serial_read_line(void);
+char *usb_serial_peek_line(void);
+void usb_serial_discard_line(void);
 
 #endif	/* usb_serial_h */